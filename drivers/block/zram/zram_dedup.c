@@ -0,0 +1,196 @@
+/*
+ * Same-content page deduplication for zram
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <linux/zsmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket per (1 << ZRAM_HASH_SHIFT) pages of disksize */
+#define ZRAM_HASH_SHIFT		10
+#define ZRAM_HASH_SIZE_MIN	(1 << 10)
+#define ZRAM_HASH_SIZE_MAX	(1 << 20)
+
+/*
+ * Identical pages compress to identical data, so the compressed buffer
+ * is hashed: it is much shorter than the page for the pages that are
+ * worth sharing.
+ */
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+static struct zram_hash *zram_dedup_hash(struct zram_meta *meta, u32 checksum)
+{
+	return &meta->hash[checksum % meta->hash_size];
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+				const unsigned char *mem, size_t len)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned char *cmem;
+	bool match;
+
+	if (entry->len != len)
+		return false;
+
+	cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(cmem, mem, len);
+	zs_unmap_object(meta->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look up an object holding exactly @len bytes of @mem. On success a
+ * reference is taken on the returned entry.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, checksum);
+	struct zram_entry *entry;
+	struct rb_node *rb_node;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum == entry->checksum) {
+			/* equal checksums sit on either side, step back */
+			struct rb_node *prev;
+
+			while ((prev = rb_prev(rb_node))) {
+				entry = rb_entry(prev, struct zram_entry,
+						rb_node);
+				if (entry->checksum != checksum)
+					break;
+				rb_node = prev;
+			}
+
+			for (; rb_node; rb_node = rb_next(rb_node)) {
+				entry = rb_entry(rb_node, struct zram_entry,
+						rb_node);
+				if (entry->checksum != checksum)
+					break;
+				if (zram_dedup_match(zram, entry, mem, len)) {
+					entry->refcount++;
+					spin_unlock(&hash->lock);
+					return entry;
+				}
+			}
+			break;
+		}
+
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else
+			rb_node = rb_node->rb_right;
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/*
+ * Make the freshly stored object @handle available for sharing. Returns
+ * the entry the slot has to keep, or NULL if there was no memory for it
+ * (the slot then keeps the plain handle).
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+		size_t len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, checksum);
+	struct zram_entry *entry, *cur;
+	struct rb_node **rb_node, *parent = NULL;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->handle = handle;
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/*
+ * Drop a slot's reference. The object is freed with the last one, in
+ * which case true is returned.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_hash(zram->meta, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount)
+		return false;
+
+	zs_free(zram->meta->mem_pool, entry->handle);
+	kfree(entry);
+
+	return true;
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	int i;
+
+	meta->hash_size = num_pages >> ZRAM_HASH_SHIFT;
+	meta->hash_size = min_t(size_t, ZRAM_HASH_SIZE_MAX, meta->hash_size);
+	meta->hash_size = max_t(size_t, ZRAM_HASH_SIZE_MIN, meta->hash_size);
+	meta->hash = vzalloc(meta->hash_size * sizeof(struct zram_hash));
+	if (!meta->hash) {
+		pr_err("Error allocating zram entry hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < meta->hash_size; i++) {
+		spin_lock_init(&meta->hash[i].lock);
+		meta->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram_meta *meta)
+{
+	vfree(meta->hash);
+	meta->hash = NULL;
+	meta->hash_size = 0;
+}
@@ -24,6 +24,7 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
@@ -34,6 +35,8 @@
 #include <linux/vmalloc.h>
 #include <linux/ratelimit.h>
 #include <linux/err.h>
+#include <linux/file.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -55,6 +58,15 @@ static const char *default_compressor = "lzo";
 /* Module params (documentation at end) */
 static unsigned int num_devices = 1;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* runs backing device I/O which can't be waited for in make_request */
+static struct workqueue_struct *zram_wb_wq;
+#endif
+#ifdef CONFIG_ZRAM_ASYNC
+/* per-CPU workers compressing the pages of async writes */
+static struct workqueue_struct *zram_async_wq;
+#endif
+
 #define ZRAM_ATTR_RO(name)						\
 static ssize_t zram_attr_##name##_show(struct device *d,		\
 				struct device_attribute *attr, char *b)	\
@@ -76,6 +88,24 @@ static inline struct zram *dev_to_zram(struct device *dev)
 	return (struct zram *)dev_to_disk(dev)->private_data;
 }
 
+static inline bool zram_async_enabled(struct zram *zram)
+{
+#ifdef CONFIG_ZRAM_ASYNC
+	return zram->use_async;
+#else
+	return false;
+#endif
+}
+
+static inline bool zram_dedup_enabled(struct zram *zram)
+{
+#ifdef CONFIG_ZRAM_DEDUP
+	return zram->use_dedup;
+#else
+	return false;
+#endif
+}
+
 static ssize_t disksize_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -121,6 +151,174 @@ static ssize_t mem_used_total_show(struct device *dev,
 	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
 }
 
+static ssize_t mem_limit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->limit_pages;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
+}
+
+static ssize_t mem_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	u64 limit;
+	char *tmp;
+	struct zram *zram = dev_to_zram(dev);
+
+	limit = memparse(buf, &tmp);
+	if (buf == tmp) /* no chars parsed, invalid input */
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->limit_pages = PAGE_ALIGN(limit) >> PAGE_SHIFT;
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t mem_used_max_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		val = atomic_long_read(&zram->stats.max_used_pages);
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
+}
+
+static ssize_t mem_used_max_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int err;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	err = kstrtoul(buf, 10, &val);
+	if (err || val != 0)
+		return -EINVAL;
+
+	/* restart the high-water mark from the current pool size */
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		atomic_long_set(&zram->stats.max_used_pages,
+				zs_get_total_pages(zram->meta->mem_pool));
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t mem_low_watermark_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->watermark_pages;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", val << PAGE_SHIFT);
+}
+
+static ssize_t mem_low_watermark_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	u64 watermark;
+	char *tmp;
+	struct zram *zram = dev_to_zram(dev);
+
+	watermark = memparse(buf, &tmp);
+	if (buf == tmp) /* no chars parsed, invalid input */
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->watermark_pages = PAGE_ALIGN(watermark) >> PAGE_SHIFT;
+	clear_bit(0, &zram->watermark_hit);
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	zs_compact(meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zs_pool_stats pool_stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	memset(&pool_stats, 0, sizeof(pool_stats));
+
+	down_read(&zram->init_lock);
+	if (init_done(zram))
+		zs_pool_stats(zram->meta->mem_pool, &pool_stats);
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%lu\n", pool_stats.pages_compacted);
+}
+
+#ifdef CONFIG_ZRAM_DEDUP
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+/*
+ * Only affects pages written from now on: slots which already share
+ * data keep doing so until they are freed or rewritten.
+ */
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+
+	return len;
+}
+#endif
+
 static ssize_t max_comp_streams_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -191,7 +389,21 @@ static ssize_t comp_algorithm_store(struct device *dev,
 	return len;
 }
 
-/* flag operations needs meta->tb_lock */
+/*
+ * Each table entry is protected by the ZRAM_ACCESS bit in its flags
+ * word, so I/O to different slots never contends on a shared lock.
+ * Flag, size and handle accessors below need the slot lock held.
+ */
+static void zram_slot_lock(struct zram_meta *meta, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static void zram_slot_unlock(struct zram_meta *meta, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
@@ -223,6 +435,15 @@ static void zram_set_obj_size(struct zram_meta *meta,
 	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
+/* zsmalloc handle of the object holding the slot's data */
+static unsigned long zram_get_handle(struct zram_meta *meta, u32 index)
+{
+	if (zram_test_flag(meta, index, ZRAM_DEDUP))
+		return meta->table[index].entry->handle;
+
+	return meta->table[index].handle;
+}
+
 static inline int is_partial_io(struct bio_vec *bvec)
 {
 	return bvec->bv_len != PAGE_SIZE;
@@ -254,6 +475,7 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 
 static void zram_meta_free(struct zram_meta *meta)
 {
+	zram_dedup_fini(meta);
 	zs_destroy_pool(meta->mem_pool);
 	vfree(meta->table);
 	kfree(meta);
@@ -280,8 +502,13 @@ static struct zram_meta *zram_meta_alloc(u64 disksize)
 		goto free_table;
 	}
 
+	if (zram_dedup_init(meta, num_pages))
+		goto free_pool;
+
 	return meta;
 
+free_pool:
+	zs_destroy_pool(meta->mem_pool);
 free_table:
 	vfree(meta->table);
 free_meta:
@@ -291,110 +518,963 @@ out:
 	return meta;
 }
 
-static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void reset_bdev(struct zram *zram)
+{
+	struct block_device *bdev;
+
+	if (!zram->backing_dev)
+		return;
+
+	bdev = zram->bdev;
+	set_blocksize(bdev, zram->old_block_size);
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	/* hope filp_close flush all of IO */
+	filp_close(zram->backing_dev, NULL);
+	zram->backing_dev = NULL;
+	zram->old_block_size = 0;
+	zram->bdev = NULL;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct file *file;
+	char *p;
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	file = zram->backing_dev;
+	if (!file) {
+		up_read(&zram->init_lock);
+		return scnprintf(buf, PAGE_SIZE, "none\n");
+	}
+
+	p = d_path(&file->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+		goto out;
+	}
+
+	ret = strlen(p);
+	memmove(buf, p, ret);
+	buf[ret++] = '\n';
+out:
+	up_read(&zram->init_lock);
+	return ret;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char *file_name;
+	size_t sz;
+	struct file *backing_dev = NULL;
+	struct inode *inode;
+	unsigned int old_block_size;
+	unsigned long nr_pages, *bitmap = NULL;
+	struct block_device *bdev = NULL;
+	int err;
+	struct zram *zram = dev_to_zram(dev);
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
+
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		pr_info("Can't setup backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	sz = strlen(file_name);
+	if (sz > 0 && file_name[sz - 1] == '\n')
+		file_name[sz - 1] = 0x00;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		backing_dev = NULL;
+		goto out;
+	}
+
+	inode = backing_dev->f_mapping->host;
+
+	/* Only block devices; a regular file can be set up through loop */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out;
+
+	reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+out:
+	if (bitmap)
+		vfree(bitmap);
+
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+
+	if (backing_dev)
+		filp_close(backing_dev, NULL);
+
+	up_write(&zram->init_lock);
+
+	kfree(file_name);
+
+	return err;
+}
+
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx = 1;
+retry:
+	/* skip 0 bit to confuse zram.handle = 0 */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, blk_idx);
+	if (blk_idx >= zram->nr_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	atomic64_inc(&zram->stats.bd_count);
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	int was_set;
+
+	was_set = test_and_clear_bit(blk_idx, zram->bitmap);
+	WARN_ON_ONCE(!was_set);
+	atomic64_dec(&zram->stats.bd_count);
+}
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int __zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long entry, int rw)
+{
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = entry * (PAGE_SIZE >> SECTOR_SHIFT);
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	bio->bi_end_io = zram_bdev_end_io;
+	bio->bi_private = &done;
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long entry;
+	int rw;
+	int ret;
+};
+
+static void zram_bdev_rw_work(struct work_struct *work)
+{
+	struct zram_bdev_work *zw = container_of(work, struct zram_bdev_work,
+						work);
+
+	zw->ret = __zram_bdev_rw(zw->zram, zw->page, zw->entry, zw->rw);
+}
+
+/*
+ * Synchronously read or write one page of the backing device.
+ */
+static int zram_bdev_rw(struct zram *zram, struct page *page,
+			unsigned long entry, int rw)
+{
+	struct zram_bdev_work zw;
+
+	/*
+	 * Bios submitted from our make_request function are only issued
+	 * once it returns, so waiting for them here would never end.
+	 * Let a worker submit and wait instead.
+	 */
+	if (!current->bio_list)
+		return __zram_bdev_rw(zram, page, entry, rw);
+
+	zw.zram = zram;
+	zw.page = page;
+	zw.entry = entry;
+	zw.rw = rw;
+	INIT_WORK_ONSTACK(&zw.work, zram_bdev_rw_work);
+	queue_work(zram_wb_wq, &zw.work);
+	flush_work(&zw.work);
+	destroy_work_on_stack(&zw.work);
+
+	return zw.ret;
+}
+#else
+static inline void reset_bdev(struct zram *zram) {}
+#endif
+
+static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
+{
+	if (*offset + bvec->bv_len >= PAGE_SIZE)
+		(*index)++;
+	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
+}
+
+static int page_zero_filled(void *ptr)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos])
+			return 0;
+	}
+
+	return 1;
+}
+
+static void handle_zero_page(struct bio_vec *bvec)
+{
+	struct page *page = bvec->bv_page;
+	void *user_mem;
+
+	user_mem = kmap_atomic(page);
+	if (is_partial_io(bvec))
+		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	else
+		clear_page(user_mem);
+	kunmap_atomic(user_mem);
+
+	flush_dcache_page(page);
+}
+
+
+static void zram_watermark_notify(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, watermark_work);
+
+	sysfs_notify(&disk_to_dev(zram->disk)->kobj, NULL, "mem_used_total");
+}
+
+/*
+ * Record the pool's high-water mark and wake mem_used_total pollers the
+ * first time the pool grows past mem_low_watermark. sysfs_notify may
+ * sleep on sysfs_mutex, so the wakeup is done from a work item.
+ */
+static void zram_update_used(struct zram *zram, unsigned long pages)
+{
+	unsigned long cur_max = atomic_long_read(&zram->stats.max_used_pages);
+	unsigned long old_max;
+
+	while (pages > cur_max) {
+		old_max = atomic_long_cmpxchg(&zram->stats.max_used_pages,
+					cur_max, pages);
+		if (old_max == cur_max)
+			break;
+		cur_max = old_max;
+	}
+
+	if (zram->watermark_pages && pages >= zram->watermark_pages &&
+	    !test_and_set_bit(0, &zram->watermark_hit))
+		schedule_work(&zram->watermark_work);
+}
+
+/* Re-arm the watermark once the pool has shrunk back below it */
+static void zram_rearm_watermark(struct zram *zram)
+{
+	if (test_bit(0, &zram->watermark_hit) &&
+	    zs_get_total_pages(zram->meta->mem_pool) < zram->watermark_pages)
+		clear_bit(0, &zram->watermark_hit);
+}
+
+/*
+ * Release the slot's compressed object, or its reference to an object
+ * shared with other slots. Caller should hold the slot lock.
+ */
+static void zram_free_obj(struct zram *zram, size_t index)
+{
+	struct zram_meta *meta = zram->meta;
+	size_t size = zram_get_obj_size(meta, index);
+
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	if (zram_test_flag(meta, index, ZRAM_RECOMP)) {
+		zram_clear_flag(meta, index, ZRAM_RECOMP);
+		atomic64_dec(&zram->stats.recomp_pages);
+	}
+#endif
+
+	if (zram_test_flag(meta, index, ZRAM_DEDUP)) {
+		zram_clear_flag(meta, index, ZRAM_DEDUP);
+		if (!zram_dedup_put(zram, meta->table[index].entry)) {
+			/* still in use by other slots */
+			atomic64_dec(&zram->stats.dedup_pages);
+			return;
+		}
+	} else {
+		zs_free(meta->mem_pool, meta->table[index].handle);
+	}
+
+	atomic64_sub(size, &zram->stats.compr_data_size);
+	zram_rearm_watermark(zram);
+}
+
+/*
+ * To protect concurrent access to the same index entry,
+ * caller should hold this table index entry's slot lock to
+ * indicate this index entry is accessing.
+ */
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle = meta->table[index].handle;
+
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_clear_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+	/*
+	 * Makes a writeback or recompression in flight drop its copy, see
+	 * writeback_slot() and recompress_slot().
+	 */
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		free_block_bdev(zram, meta->table[index].element);
+		meta->table[index].element = 0;
+		atomic64_dec(&zram->stats.pages_stored);
+		return;
+	}
+#endif
+
+	if (unlikely(!handle)) {
+		/*
+		 * No memory is allocated for zero filled pages.
+		 * Simply clear zero page flag.
+		 */
+		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
+			zram_clear_flag(meta, index, ZRAM_ZERO);
+			atomic64_dec(&zram->stats.zero_pages);
+		}
+		return;
+	}
+
+	zram_free_obj(zram, index);
+	atomic64_dec(&zram->stats.pages_stored);
+
+	meta->table[index].handle = 0;
+	zram_set_obj_size(meta, index, 0);
+}
+
+/*
+ * Returns -EAGAIN if the page has been written back to the backing
+ * device; it has to be read from there with a sleepable buffer.
+ */
+static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+{
+	int ret = 0;
+	unsigned char *cmem;
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle;
+	size_t size;
+	struct zcomp *comp = zram->comp;
+
+	zram_slot_lock(meta, index);
+	handle = meta->table[index].handle;
+	size = zram_get_obj_size(meta, index);
+
+	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
+		zram_slot_unlock(meta, index);
+		clear_page(mem);
+		return 0;
+	}
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_slot_unlock(meta, index);
+		return -EAGAIN;
+	}
+
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	if (zram_test_flag(meta, index, ZRAM_RECOMP))
+		comp = zram->recomp;
+#endif
+
+	handle = zram_get_handle(meta, index);
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
+	if (size == PAGE_SIZE)
+		copy_page(mem, cmem);
+	else
+		ret = zcomp_decompress(comp, cmem, size, mem);
+	zs_unmap_object(meta->mem_pool, handle);
+	zram_slot_unlock(meta, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		return ret;
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		zram_slot_lock(meta, index);
+		if (meta->table[index].handle &&
+				!zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_slot_unlock(meta, index);
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+#endif
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Read the page of a written back slot into @page */
+static int read_from_bdev(struct zram *zram, struct page *page, u32 index)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long entry;
+	void *mem;
+	int ret;
+
+	for (;;) {
+		zram_slot_lock(meta, index);
+		if (zram_test_flag(meta, index, ZRAM_WB))
+			break;
+		zram_slot_unlock(meta, index);
+
+		/* The slot was rewritten meanwhile, it is in memory again */
+		mem = kmap_atomic(page);
+		ret = zram_decompress_page(zram, mem, index);
+		kunmap_atomic(mem);
+		if (ret != -EAGAIN)
+			return ret;
+	}
+	entry = meta->table[index].element;
+	zram_slot_unlock(meta, index);
+
+	atomic64_inc(&zram->stats.bd_reads);
+	return zram_bdev_rw(zram, page, entry, READ);
+}
+
+static int zram_bvec_read_bdev(struct zram *zram, struct bio_vec *bvec,
+				u32 index, int offset)
+{
+	struct page *page;
+	void *src, *dst;
+	int ret;
+
+	if (!is_partial_io(bvec)) {
+		ret = read_from_bdev(zram, bvec->bv_page, index);
+		if (!ret)
+			flush_dcache_page(bvec->bv_page);
+		return ret;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = read_from_bdev(zram, page, index);
+	if (!ret) {
+		src = kmap_atomic(page);
+		dst = kmap_atomic(bvec->bv_page);
+		memcpy(dst + bvec->bv_offset, src + offset, bvec->bv_len);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+		flush_dcache_page(bvec->bv_page);
+	}
+	__free_page(page);
+
+	return ret;
+}
+
+/* Like zram_decompress_page(), for a written back slot */
+static int zram_read_bdev_buf(struct zram *zram, char *mem, u32 index)
+{
+	struct page *page;
+	void *src;
+	int ret;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = read_from_bdev(zram, page, index);
+	if (!ret) {
+		src = kmap_atomic(page);
+		copy_page(mem, src);
+		kunmap_atomic(src);
+	}
+	__free_page(page);
+
+	return ret;
+}
+
+/*
+ * Store an incompressible page on the backing device instead of in the
+ * pool. @uncmem holds the page data for partial I/O.
+ */
+static int write_to_bdev(struct zram *zram, struct bio_vec *bvec,
+			char *uncmem, u32 index)
+{
+	struct zram_meta *meta = zram->meta;
+	struct page *page = bvec->bv_page;
+	unsigned long entry;
+	void *dst;
+	int ret;
+
+	if (is_partial_io(bvec)) {
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			return -ENOMEM;
+		dst = kmap_atomic(page);
+		copy_page(dst, uncmem);
+		kunmap_atomic(dst);
+	}
+
+	entry = alloc_block_bdev(zram);
+	if (!entry) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = zram_bdev_rw(zram, page, entry, WRITE);
+	if (ret) {
+		free_block_bdev(zram, entry);
+		goto out;
+	}
+	atomic64_inc(&zram->stats.bd_writes);
+
+	zram_slot_lock(meta, index);
+	zram_free_page(zram, index);
+	zram_set_flag(meta, index, ZRAM_WB);
+	meta->table[index].element = entry;
+	zram_slot_unlock(meta, index);
+
+	atomic64_inc(&zram->stats.pages_stored);
+out:
+	if (page != bvec->bv_page)
+		__free_page(page);
+	return ret;
+}
+
+/*
+ * Move one slot out to the backing device if it matches the writeback
+ * mode. @page is scratch space for the uncompressed data.
+ */
+static int writeback_slot(struct zram *zram, struct page *page, u32 index,
+			bool huge_only)
+{
+	struct zram_meta *meta = zram->meta;
+	unsigned long handle, entry;
+	void *mem;
+	int ret;
+
+	zram_slot_lock(meta, index);
+	handle = meta->table[index].handle;
+	if (!handle || zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_RECOMP))
+		goto skip;
+	if (huge_only && !zram_test_flag(meta, index, ZRAM_HUGE))
+		goto skip;
+	if (!huge_only && !zram_test_flag(meta, index, ZRAM_IDLE))
+		goto skip;
+	zram_set_flag(meta, index, ZRAM_UNDER_WB);
+	zram_slot_unlock(meta, index);
+
+	mem = kmap_atomic(page);
+	ret = zram_decompress_page(zram, mem, index);
+	kunmap_atomic(mem);
+	if (ret)
+		goto clear_under_wb;
+
+	entry = alloc_block_bdev(zram);
+	if (!entry) {
+		ret = -ENOSPC;
+		goto clear_under_wb;
+	}
+
+	ret = zram_bdev_rw(zram, page, entry, WRITE);
+	if (ret) {
+		free_block_bdev(zram, entry);
+		goto clear_under_wb;
+	}
+	atomic64_inc(&zram->stats.bd_writes);
+
+	zram_slot_lock(meta, index);
+	/*
+	 * The slot was freed or overwritten while the I/O was in flight
+	 * (zram_free_page() clears ZRAM_UNDER_WB): drop our copy.
+	 */
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_WB)) {
+		zram_slot_unlock(meta, index);
+		free_block_bdev(zram, entry);
+		return 0;
+	}
+
+	zram_free_obj(zram, index);
+	zram_set_obj_size(meta, index, 0);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_set_flag(meta, index, ZRAM_WB);
+	meta->table[index].element = entry;
+	zram_slot_unlock(meta, index);
+
+	return 0;
+
+skip:
+	zram_slot_unlock(meta, index);
+	return 0;
+
+clear_under_wb:
+	zram_slot_lock(meta, index);
+	zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+	zram_slot_unlock(meta, index);
+	return ret;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long nr_pages, index;
+	struct page *page;
+	bool huge_only;
+	ssize_t ret;
+
+	if (sysfs_streq(buf, "idle"))
+		huge_only = false;
+	else if (sysfs_streq(buf, "huge"))
+		huge_only = true;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
+	}
+
+	if (!zram->backing_dev) {
+		ret = -ENODEV;
+		goto release_init_lock;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	ret = len;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		int err = writeback_slot(zram, page, index, huge_only);
+
+		/* backing device is full */
+		if (err == -ENOSPC)
+			break;
+		if (err)
+			ret = err;
+		cond_resched();
+	}
+
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
+}
+#else
+static inline int zram_bvec_read_bdev(struct zram *zram, struct bio_vec *bvec,
+				u32 index, int offset)
 {
-	if (*offset + bvec->bv_len >= PAGE_SIZE)
-		(*index)++;
-	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
+	return -EIO;
 }
 
-static int page_zero_filled(void *ptr)
+static inline int zram_read_bdev_buf(struct zram *zram, char *mem, u32 index)
 {
-	unsigned int pos;
-	unsigned long *page;
+	return -EIO;
+}
+#endif
 
-	page = (unsigned long *)ptr;
+#ifdef CONFIG_ZRAM_MULTI_COMP
+static ssize_t recomp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
-			return 0;
-	}
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->recomp_compressor, buf);
+	up_read(&zram->init_lock);
 
-	return 1;
+	return sz;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static ssize_t recomp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
-	struct page *page = bvec->bv_page;
-	void *user_mem;
-
-	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
-		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
-	kunmap_atomic(user_mem);
-
-	flush_dcache_page(page);
+	struct zram *zram = dev_to_zram(dev);
+	down_write(&zram->init_lock);
+	if (init_done(zram)) {
+		up_write(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->recomp_compressor, buf,
+		sizeof(zram->recomp_compressor));
+	up_write(&zram->init_lock);
+	return len;
 }
 
+#define RECOMP_IDLE	BIT(0)
+#define RECOMP_HUGE	BIT(1)
 
 /*
- * To protect concurrent access to the same index entry,
- * caller should hold this table index entry's bit_spinlock to
- * indicate this index entry is accessing.
+ * Re-encode one slot with the secondary algorithm if it matches @mode and
+ * the result is smaller. @page is scratch space for the uncompressed data.
+ * The slot lock is dropped while compressing and allocating; a write or
+ * free in that window clears ZRAM_UNDER_RECOMP and our copy is dropped.
  */
-static void zram_free_page(struct zram *zram, size_t index)
+static int recompress_slot(struct zram *zram, struct zcomp_strm *zstrm,
+			struct page *page, u32 index, unsigned long mode)
 {
 	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
+	unsigned long handle, alloced_pages;
+	size_t size, clen;
+	void *mem, *cmem;
+	int ret;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
-			atomic64_dec(&zram->stats.zero_pages);
-		}
-		return;
+	zram_slot_lock(meta, index);
+	handle = meta->table[index].handle;
+	if (!handle || zram_test_flag(meta, index, ZRAM_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_WB) ||
+			zram_test_flag(meta, index, ZRAM_UNDER_RECOMP) ||
+			zram_test_flag(meta, index, ZRAM_RECOMP) ||
+			zram_test_flag(meta, index, ZRAM_INCOMPRESSIBLE) ||
+			zram_test_flag(meta, index, ZRAM_DEDUP))
+		goto skip;
+	if ((mode & RECOMP_IDLE) && !zram_test_flag(meta, index, ZRAM_IDLE))
+		goto skip;
+	if ((mode & RECOMP_HUGE) && !zram_test_flag(meta, index, ZRAM_HUGE))
+		goto skip;
+	size = zram_get_obj_size(meta, index);
+	zram_set_flag(meta, index, ZRAM_UNDER_RECOMP);
+	zram_slot_unlock(meta, index);
+
+	mem = kmap_atomic(page);
+	ret = zram_decompress_page(zram, mem, index);
+	if (!ret)
+		ret = zcomp_compress(zram->recomp, zstrm, mem, &clen);
+	kunmap_atomic(mem);
+	if (ret) {
+		/* -EAGAIN: rewritten and written back meanwhile, nothing to do */
+		if (ret == -EAGAIN)
+			ret = 0;
+		goto clear_under_recomp;
 	}
 
-	zs_free(meta->mem_pool, handle);
-
-	atomic64_sub(zram_get_obj_size(meta, index),
-			&zram->stats.compr_data_size);
-	atomic64_dec(&zram->stats.pages_stored);
+	if (clen >= size || clen > max_zpage_size) {
+		zram_slot_lock(meta, index);
+		/* don't try this slot again until it is rewritten */
+		if (zram_test_flag(meta, index, ZRAM_UNDER_RECOMP))
+			zram_set_flag(meta, index, ZRAM_INCOMPRESSIBLE);
+		zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+		zram_slot_unlock(meta, index);
+		return 0;
+	}
 
-	meta->table[index].handle = 0;
-	zram_set_obj_size(meta, index, 0);
-}
+	handle = zs_malloc(meta->mem_pool, clen);
+	if (!handle) {
+		ret = -ENOMEM;
+		goto clear_under_recomp;
+	}
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
-{
-	int ret = 0;
-	unsigned char *cmem;
-	struct zram_meta *meta = zram->meta;
-	unsigned long handle;
-	size_t size;
+	alloced_pages = zs_get_total_pages(meta->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(meta->mem_pool, handle);
+		ret = -ENOMEM;
+		goto clear_under_recomp;
+	}
+	zram_update_used(zram, alloced_pages);
 
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
-	handle = meta->table[index].handle;
-	size = zram_get_obj_size(meta, index);
+	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(meta->mem_pool, handle);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
-		clear_page(mem);
+	zram_slot_lock(meta, index);
+	if (!zram_test_flag(meta, index, ZRAM_UNDER_RECOMP)) {
+		zram_slot_unlock(meta, index);
+		zs_free(meta->mem_pool, handle);
 		return 0;
 	}
 
-	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
-	if (size == PAGE_SIZE)
-		copy_page(mem, cmem);
+	zram_free_obj(zram, index);
+	meta->table[index].handle = handle;
+	zram_set_obj_size(meta, index, clen);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	zram_clear_flag(meta, index, ZRAM_HUGE);
+	zram_set_flag(meta, index, ZRAM_RECOMP);
+	zram_slot_unlock(meta, index);
+
+	atomic64_add(clen, &zram->stats.compr_data_size);
+	atomic64_inc(&zram->stats.recomp_pages);
+	return 0;
+
+skip:
+	zram_slot_unlock(meta, index);
+	return 0;
+
+clear_under_recomp:
+	zram_slot_lock(meta, index);
+	zram_clear_flag(meta, index, ZRAM_UNDER_RECOMP);
+	zram_slot_unlock(meta, index);
+	return ret;
+}
+
+/*
+ * "idle" recompresses slots marked through the idle attribute, "huge"
+ * the ones stored uncompressed and "huge_idle" slots that are both.
+ */
+static ssize_t recompress_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long nr_pages, index, mode;
+	struct zcomp_strm *zstrm;
+	struct page *page;
+	ssize_t ret;
+
+	if (sysfs_streq(buf, "idle"))
+		mode = RECOMP_IDLE;
+	else if (sysfs_streq(buf, "huge"))
+		mode = RECOMP_HUGE;
+	else if (sysfs_streq(buf, "huge_idle"))
+		mode = RECOMP_IDLE | RECOMP_HUGE;
 	else
-		ret = zcomp_decompress(zram->comp, cmem, size, mem);
-	zs_unmap_object(meta->mem_pool, handle);
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		return -EINVAL;
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		return ret;
+	down_read(&zram->init_lock);
+	if (!init_done(zram)) {
+		ret = -EINVAL;
+		goto release_init_lock;
 	}
 
-	return 0;
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto release_init_lock;
+	}
+
+	ret = len;
+	zstrm = zcomp_strm_find(zram->recomp);
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		int err = recompress_slot(zram, zstrm, page, index, mode);
+
+		/* pool is full, leave the remaining slots alone */
+		if (err == -ENOMEM) {
+			ret = err;
+			break;
+		}
+		if (err)
+			ret = err;
+		cond_resched();
+	}
+	zcomp_strm_release(zram->recomp, zstrm);
+
+	__free_page(page);
+release_init_lock:
+	up_read(&zram->init_lock);
+
+	return ret;
 }
+#endif
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
@@ -405,14 +1485,15 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_slot_lock(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
 	if (unlikely(!meta->table[index].handle) ||
 			zram_test_flag(meta, index, ZRAM_ZERO)) {
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_slot_unlock(meta, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_slot_unlock(meta, index);
 
 	if (is_partial_io(bvec))
 		/* Use  a temporary buffer to decompress the page */
@@ -429,6 +1510,13 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	}
 
 	ret = zram_decompress_page(zram, uncmem, index);
+	if (unlikely(ret == -EAGAIN)) {
+		/* backing device I/O can't target an atomic mapping */
+		kunmap_atomic(user_mem);
+		if (is_partial_io(bvec))
+			kfree(uncmem);
+		return zram_bvec_read_bdev(zram, bvec, index, offset);
+	}
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret))
 		goto out_cleanup;
@@ -451,13 +1539,16 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret = 0;
 	size_t clen;
-	unsigned long handle;
+	unsigned long handle = 0, alloced_pages;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
 	static unsigned long zram_rs_time;
 	struct zcomp_strm *zstrm;
 	bool locked = false;
+	struct zram_entry *entry = NULL;
+	bool dedup = false;
+	u32 checksum = 0;
 
 	page = bvec->bv_page;
 	if (is_partial_io(bvec)) {
@@ -471,6 +1562,8 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 		ret = zram_decompress_page(zram, uncmem, index);
+		if (ret == -EAGAIN)
+			ret = zram_read_bdev_buf(zram, uncmem, index);
 		if (ret)
 			goto out;
 	}
@@ -491,10 +1584,10 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem);
 		/* Free memory associated with this sector now. */
-		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_slot_lock(meta, index);
 		zram_free_page(zram, index);
 		zram_set_flag(meta, index, ZRAM_ZERO);
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_slot_unlock(meta, index);
 
 		atomic64_inc(&zram->stats.zero_pages);
 		ret = 0;
@@ -517,6 +1610,28 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		clen = PAGE_SIZE;
 		if (is_partial_io(bvec))
 			src = uncmem;
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* No memory saving: keep it on the backing device instead */
+		if (zram->backing_dev) {
+			zcomp_strm_release(zram->comp, zstrm);
+			locked = false;
+			if (!write_to_bdev(zram, bvec, uncmem, index))
+				goto out;
+		}
+#endif
+	}
+
+	if (zram_dedup_enabled(zram) && clen != PAGE_SIZE) {
+		dedup = true;
+		checksum = zram_dedup_checksum(src, clen);
+		entry = zram_dedup_find(zram, src, clen, checksum);
+		if (entry) {
+			/* Another slot already holds this data, share it */
+			zcomp_strm_release(zram->comp, zstrm);
+			locked = false;
+			atomic64_inc(&zram->stats.dedup_pages);
+			goto store;
+		}
 	}
 
 	handle = zs_malloc(meta->mem_pool, clen);
@@ -528,6 +1643,15 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	alloced_pages = zs_get_total_pages(meta->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(meta->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out;
+	}
+	zram_update_used(zram, alloced_pages);
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
@@ -538,23 +1662,36 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		memcpy(cmem, src, clen);
 	}
 
-	zcomp_strm_release(zram->comp, zstrm);
-	locked = false;
+	if (locked) {
+		zcomp_strm_release(zram->comp, zstrm);
+		locked = false;
+	}
 	zs_unmap_object(meta->mem_pool, handle);
 
+	if (dedup)
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+	atomic64_add(clen, &zram->stats.compr_data_size);
+
+store:
 	/*
 	 * Free memory associated with this sector
 	 * before overwriting unused sectors.
 	 */
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_slot_lock(meta, index);
 	zram_free_page(zram, index);
 
-	meta->table[index].handle = handle;
+	if (entry) {
+		meta->table[index].entry = entry;
+		zram_set_flag(meta, index, ZRAM_DEDUP);
+	} else {
+		meta->table[index].handle = handle;
+	}
 	zram_set_obj_size(meta, index, clen);
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	if (clen == PAGE_SIZE)
+		zram_set_flag(meta, index, ZRAM_HUGE);
+	zram_slot_unlock(meta, index);
 
 	/* Update stats */
-	atomic64_add(clen, &zram->stats.compr_data_size);
 	atomic64_inc(&zram->stats.pages_stored);
 out:
 	if (locked)
@@ -618,9 +1755,9 @@ static void zram_bio_discard(struct zram *zram, u32 index,
 	}
 
 	while (n >= PAGE_SIZE) {
-		bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_slot_lock(meta, index);
 		zram_free_page(zram, index);
-		bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+		zram_slot_unlock(meta, index);
 		index++;
 		n -= PAGE_SIZE;
 	}
@@ -633,21 +1770,35 @@ static void zram_reset_device(struct zram *zram, bool reset_capacity)
 
 	down_write(&zram->init_lock);
 	if (!init_done(zram)) {
+		reset_bdev(zram);
 		up_write(&zram->init_lock);
 		return;
 	}
 
+#ifdef CONFIG_ZRAM_ASYNC
+	/* async writes queued before we took init_lock must land first */
+	flush_workqueue(zram_async_wq);
+#endif
+
 	meta = zram->meta;
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = meta->table[index].handle;
 		if (!handle)
 			continue;
+		/* backing device blocks go away with the bitmap */
+		if (zram_test_flag(meta, index, ZRAM_WB))
+			continue;
 
-		zs_free(meta->mem_pool, handle);
+		zram_free_obj(zram, index);
 	}
+	reset_bdev(zram);
 
 	zcomp_destroy(zram->comp);
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	zcomp_destroy(zram->recomp);
+	zram->recomp = NULL;
+#endif
 	zram->max_comp_streams = 1;
 
 	zram_meta_free(zram->meta);
@@ -655,6 +1806,9 @@ static void zram_reset_device(struct zram *zram, bool reset_capacity)
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
+	zram->limit_pages = 0;
+	zram->watermark_pages = 0;
+	clear_bit(0, &zram->watermark_hit);
 	zram->disksize = 0;
 	if (reset_capacity)
 		set_capacity(zram->disk, 0);
@@ -674,7 +1828,7 @@ static ssize_t disksize_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t len)
 {
 	u64 disksize;
-	struct zcomp *comp;
+	struct zcomp *comp, *recomp = NULL;
 	struct zram_meta *meta;
 	struct zram *zram = dev_to_zram(dev);
 	int err;
@@ -696,6 +1850,17 @@ static ssize_t disksize_store(struct device *dev,
 		goto out_free_meta;
 	}
 
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	recomp = zcomp_create(zram->recomp_compressor, zram->max_comp_streams);
+	if (IS_ERR(recomp)) {
+		pr_info("Cannot initialise %s compressing backend\n",
+				zram->recomp_compressor);
+		err = PTR_ERR(recomp);
+		zcomp_destroy(comp);
+		goto out_free_meta;
+	}
+#endif
+
 	down_write(&zram->init_lock);
 	if (init_done(zram)) {
 		pr_info("Cannot change disksize for initialized device\n");
@@ -705,6 +1870,9 @@ static ssize_t disksize_store(struct device *dev,
 
 	zram->meta = meta;
 	zram->comp = comp;
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	zram->recomp = recomp;
+#endif
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 	up_write(&zram->init_lock);
@@ -720,6 +1888,8 @@ static ssize_t disksize_store(struct device *dev,
 
 out_destroy_comp:
 	up_write(&zram->init_lock);
+	if (recomp)
+		zcomp_destroy(recomp);
 	zcomp_destroy(comp);
 out_free_meta:
 	zram_meta_free(meta);
@@ -767,6 +1937,146 @@ out:
 	return ret;
 }
 
+#ifdef CONFIG_ZRAM_ASYNC
+/* A run of full pages of an async write, stored by one CPU */
+struct zram_batch {
+	struct work_struct work;
+	struct zram_async_bio *abio;
+	u32 index;		/* zram page of the first segment */
+	unsigned short seg;	/* first bio segment of the batch */
+	unsigned short nr_segs;
+};
+
+struct zram_async_bio {
+	struct zram *zram;
+	struct bio *bio;
+	atomic_t pending;	/* batches not yet stored */
+	int error;
+	struct zram_batch batch[0];
+};
+
+static ssize_t async_write_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	bool val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->use_async;
+	up_read(&zram->init_lock);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", (int)val);
+}
+
+static ssize_t async_write_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->use_async = val;
+	up_write(&zram->init_lock);
+
+	return len;
+}
+
+static void zram_batch_work(struct work_struct *work)
+{
+	struct zram_batch *batch = container_of(work, struct zram_batch, work);
+	struct zram_async_bio *abio = batch->abio;
+	struct zram *zram = abio->zram;
+	struct bio *bio = abio->bio;
+	int i;
+
+	for (i = 0; i < batch->nr_segs; i++) {
+		struct bio_vec *bvec = bio_iovec_idx(bio, batch->seg + i);
+
+		if (zram_bvec_rw(zram, bvec, batch->index + i, 0, bio) < 0)
+			abio->error = -EIO;
+	}
+	atomic64_sub(batch->nr_segs, &zram->stats.async_depth);
+
+	if (atomic_dec_and_test(&abio->pending)) {
+		if (!abio->error)
+			set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, abio->error);
+		kfree(abio);
+	}
+}
+
+/*
+ * Hand a write over to the per-CPU workers: its pages are cut into at
+ * most one batch per online CPU and the bio completes once every batch
+ * is stored. Returns false, and leaves the bio alone, if the write has
+ * to go through the synchronous path: partial pages (their
+ * read-modify-write must not race on a slot), too many pages already
+ * queued, or no memory for the batches.
+ */
+static bool zram_async_write(struct zram *zram, struct bio *bio, u32 index,
+			int offset)
+{
+	struct zram_async_bio *abio;
+	struct bio_vec *bvec;
+	int i, nr_segs, nr_batches, per_batch, cpu;
+
+	if (offset)
+		return false;
+	bio_for_each_segment(bvec, bio, i)
+		if (bvec->bv_len != PAGE_SIZE || bvec->bv_offset)
+			return false;
+
+	nr_segs = bio_segments(bio);
+	if (atomic64_read(&zram->stats.async_depth) + nr_segs >
+			max_async_depth)
+		return false;
+
+	nr_batches = min_t(int, nr_segs, num_online_cpus());
+	per_batch = DIV_ROUND_UP(nr_segs, nr_batches);
+	nr_batches = DIV_ROUND_UP(nr_segs, per_batch);
+
+	abio = kmalloc(sizeof(*abio) + nr_batches * sizeof(abio->batch[0]),
+			GFP_NOIO | __GFP_NOWARN);
+	if (!abio)
+		return false;
+
+	abio->zram = zram;
+	abio->bio = bio;
+	abio->error = 0;
+	atomic_set(&abio->pending, nr_batches);
+	atomic64_add(nr_segs, &zram->stats.async_depth);
+
+	for (i = 0; i < nr_batches; i++) {
+		struct zram_batch *batch = &abio->batch[i];
+		int first = i * per_batch;
+
+		batch->abio = abio;
+		batch->index = index + first;
+		batch->seg = bio->bi_idx + first;
+		batch->nr_segs = min(per_batch, nr_segs - first);
+		INIT_WORK(&batch->work, zram_batch_work);
+
+		/* spread single-page swap writes across CPUs as well */
+		cpu = cpumask_next(zram->async_cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		zram->async_cpu = cpu;
+		queue_work_on(cpu, zram_async_wq, &batch->work);
+	}
+
+	return true;
+}
+#else
+static inline bool zram_async_write(struct zram *zram, struct bio *bio,
+				u32 index, int offset)
+{
+	return false;
+}
+#endif
+
 static void __zram_make_request(struct zram *zram, struct bio *bio)
 {
 	int i, offset;
@@ -782,6 +2092,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio)
 		return;
 	}
 
+	if (zram_async_enabled(zram) && bio_data_dir(bio) == WRITE &&
+	    zram_async_write(zram, bio, index, offset))
+		return;
+
 	bio_for_each_segment(bvec, bio, i) {
 		int max_transfer_size = PAGE_SIZE - offset;
 
@@ -855,9 +2169,9 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	zram = bdev->bd_disk->private_data;
 	meta = zram->meta;
 
-	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_slot_lock(meta, index);
 	zram_free_page(zram, index);
-	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+	zram_slot_unlock(meta, index);
 	atomic64_inc(&zram->stats.notify_free);
 }
 
@@ -872,10 +2186,39 @@ static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(mem_limit, S_IRUGO | S_IWUSR, mem_limit_show,
+		mem_limit_store);
+static DEVICE_ATTR(mem_used_max, S_IRUGO | S_IWUSR, mem_used_max_show,
+		mem_used_max_store);
+static DEVICE_ATTR(mem_low_watermark, S_IRUGO | S_IWUSR,
+		mem_low_watermark_show, mem_low_watermark_store);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
 static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
 		max_comp_streams_show, max_comp_streams_store);
 static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
 		comp_algorithm_show, comp_algorithm_store);
+#ifdef CONFIG_ZRAM_DEDUP
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+static DEVICE_ATTR(recomp_algorithm, S_IRUGO | S_IWUSR,
+		recomp_algorithm_show, recomp_algorithm_store);
+static DEVICE_ATTR(recompress, S_IWUSR, NULL, recompress_store);
+#endif
+#ifdef CONFIG_ZRAM_ASYNC
+static DEVICE_ATTR(async_write, S_IRUGO | S_IWUSR,
+		async_write_show, async_write_store);
+#endif
 
 ZRAM_ATTR_RO(num_reads);
 ZRAM_ATTR_RO(num_writes);
@@ -885,6 +2228,20 @@ ZRAM_ATTR_RO(invalid_io);
 ZRAM_ATTR_RO(notify_free);
 ZRAM_ATTR_RO(zero_pages);
 ZRAM_ATTR_RO(compr_data_size);
+#ifdef CONFIG_ZRAM_DEDUP
+ZRAM_ATTR_RO(dedup_pages);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+ZRAM_ATTR_RO(bd_count);
+ZRAM_ATTR_RO(bd_reads);
+ZRAM_ATTR_RO(bd_writes);
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+ZRAM_ATTR_RO(recomp_pages);
+#endif
+#ifdef CONFIG_ZRAM_ASYNC
+ZRAM_ATTR_RO(async_depth);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -900,8 +2257,36 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_mem_limit.attr,
+	&dev_attr_mem_used_max.attr,
+	&dev_attr_mem_low_watermark.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_pages_compacted.attr,
 	&dev_attr_max_comp_streams.attr,
 	&dev_attr_comp_algorithm.attr,
+#ifdef CONFIG_ZRAM_DEDUP
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dedup_pages.attr,
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+#endif
+#if defined(CONFIG_ZRAM_WRITEBACK) || defined(CONFIG_ZRAM_MULTI_COMP)
+	&dev_attr_idle.attr,
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	&dev_attr_recomp_algorithm.attr,
+	&dev_attr_recompress.attr,
+	&dev_attr_recomp_pages.attr,
+#endif
+#ifdef CONFIG_ZRAM_ASYNC
+	&dev_attr_async_write.attr,
+	&dev_attr_async_depth.attr,
+#endif
 	NULL,
 };
 
@@ -914,6 +2299,7 @@ static int create_device(struct zram *zram, int device_id)
 	int ret = -ENOMEM;
 
 	init_rwsem(&zram->init_lock);
+	INIT_WORK(&zram->watermark_work, zram_watermark_notify);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -978,6 +2364,10 @@ static int create_device(struct zram *zram, int device_id)
 		goto out_free_disk;
 	}
 	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	strlcpy(zram->recomp_compressor, "lz4hc",
+		sizeof(zram->recomp_compressor));
+#endif
 	zram->meta = NULL;
 	zram->max_comp_streams = 1;
 	return 0;
@@ -995,6 +2385,7 @@ static void destroy_device(struct zram *zram)
 {
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
+	cancel_work_sync(&zram->watermark_work);
 
 	del_gendisk(zram->disk);
 	put_disk(zram->disk);
@@ -1013,11 +2404,27 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_wb_wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!zram_wb_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+#endif
+#ifdef CONFIG_ZRAM_ASYNC
+	zram_async_wq = alloc_workqueue("zram_async",
+					WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+	if (!zram_async_wq) {
+		ret = -ENOMEM;
+		goto destroy_wb_wq;
+	}
+#endif
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -1043,6 +2450,14 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+#ifdef CONFIG_ZRAM_ASYNC
+	destroy_workqueue(zram_async_wq);
+destroy_wb_wq:
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_wb_wq);
+#endif
 out:
 	return ret;
 }
@@ -1066,6 +2481,12 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+#ifdef CONFIG_ZRAM_ASYNC
+	destroy_workqueue(zram_async_wq);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	destroy_workqueue(zram_wb_wq);
+#endif
 	pr_debug("Cleanup done!\n");
 }
 
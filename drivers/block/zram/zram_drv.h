@@ -17,9 +17,11 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/zsmalloc.h>
 
 #include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -41,6 +43,14 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
  * always return failure.
  */
 
+#ifdef CONFIG_ZRAM_ASYNC
+/*
+ * Pages of async writes that may be queued for compression at once;
+ * writes beyond that are compressed by the submitter.
+ */
+static const unsigned max_async_depth = 256;
+#endif
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -61,14 +71,25 @@ static const size_t max_zpage_size = PAGE_SIZE / 10 * 9;
  * footprint small so we can squeeze size and flags into a field.
  * The lower ZRAM_FLAG_SHIFT bits is for object size (excluding header),
  * the higher bits is for zram_pageflags.
+ *
+ * An object is at most PAGE_SIZE bytes, so PAGE_SHIFT + 1 size bits are
+ * enough and leave room for all the flags in a 32-bit value.
  */
-#define ZRAM_FLAG_SHIFT 24
+#define ZRAM_FLAG_SHIFT (PAGE_SHIFT + 1)
 
 /* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page consists entirely of zeros */
-	ZRAM_ZERO = ZRAM_FLAG_SHIFT + 1,
+	ZRAM_ZERO = ZRAM_FLAG_SHIFT,
 	ZRAM_ACCESS,	/* page in now accessed */
+	ZRAM_WB,	/* page is stored on backing_device */
+	ZRAM_UNDER_WB,	/* page is under writeback */
+	ZRAM_HUGE,	/* Incompressible page */
+	ZRAM_IDLE,	/* not accessed page since last idle marking */
+	ZRAM_DEDUP,	/* entry points to a shared zram_entry */
+	ZRAM_RECOMP,	/* compressed with the secondary algorithm */
+	ZRAM_UNDER_RECOMP,	/* page is being recompressed */
+	ZRAM_INCOMPRESSIBLE,	/* secondary algorithm did not help */
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -77,7 +98,11 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct zram_table_entry {
-	unsigned long handle;
+	union {
+		unsigned long handle;
+		unsigned long element;	/* backing device block (ZRAM_WB) */
+		struct zram_entry *entry;	/* shared object (ZRAM_DEDUP) */
+	};
 	unsigned long value;
 };
 
@@ -91,11 +116,28 @@ struct zram_stats {
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
 	atomic64_t zero_pages;		/* no. of zero filled pages */
 	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t dedup_pages;		/* no. of pages sharing another's data */
+	atomic_long_t max_used_pages;	/* highest pool size seen, in pages */
+#ifdef CONFIG_ZRAM_ASYNC
+	atomic64_t async_depth;		/* no. of async pages not yet stored */
+#endif
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	atomic64_t recomp_pages;	/* no. of pages using the secondary algorithm */
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	atomic64_t bd_count;		/* no. of pages in backing device */
+	atomic64_t bd_reads;		/* no. of reads from backing device */
+	atomic64_t bd_writes;		/* no. of writes from backing device */
+#endif
 };
 
 struct zram_meta {
 	struct zram_table_entry *table;
 	struct zs_pool *mem_pool;
+#ifdef CONFIG_ZRAM_DEDUP
+	struct zram_hash *hash;
+	size_t hash_size;
+#endif
 };
 
 struct zram {
@@ -103,6 +145,10 @@ struct zram {
 	struct request_queue *queue;
 	struct gendisk *disk;
 	struct zcomp *comp;
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	/* secondary algorithm for cold pages, see recompress_store() */
+	struct zcomp *recomp;
+#endif
 
 	/* Prevent concurrent execution of device init, reset and R/W request */
 	struct rw_semaphore init_lock;
@@ -112,7 +158,31 @@ struct zram {
 	 */
 	u64 disksize;	/* bytes */
 	int max_comp_streams;
+	/* share the data of identical pages, see zram_dedup.c */
+	bool use_dedup;
+#ifdef CONFIG_ZRAM_ASYNC
+	/* compress writes on the per-CPU workers, see zram_async_write() */
+	bool use_async;
+	int async_cpu;		/* last CPU given a batch */
+#endif
+	/* cap on the compressed pool, in pages; 0 means no limit */
+	unsigned long limit_pages;
+	/* pool size that wakes mem_used_total pollers, in pages */
+	unsigned long watermark_pages;
+	unsigned long watermark_hit;	/* bit 0: pollers already woken */
+	struct work_struct watermark_work;
 	struct zram_stats stats;
 	char compressor[10];
+#ifdef CONFIG_ZRAM_MULTI_COMP
+	char recomp_compressor[10];
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* one bit per backing device block, bit 0 is never used */
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+#endif
 };
 #endif
@@ -17,7 +17,7 @@
 #include <linux/device.h>
 #include <linux/file.h>
 #include <linux/fs.h>
-#include <linux/anon_inodes.h>
+#include <linux/dma-buf.h>
 #include <linux/ion.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
@@ -130,7 +130,11 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
-/* this function should only be called while dev->lock is held */
+/*
+ * this function should only be called while dev->lock is held; the lock
+ * is dropped while a deferred free list is drained, and heaps are never
+ * removed, so callers may keep walking dev->heaps afterwards
+ */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -148,6 +152,13 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	kref_init(&buffer->ref);
 
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	if (ret && (heap->flags & ION_HEAP_FLAG_DEFER_FREE)) {
+		/* memory may just be sitting on the deferred free list */
+		mutex_unlock(&dev->lock);
+		ion_heap_freelist_drain(heap, 0);
+		mutex_lock(&dev->lock);
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	}
 	if (ret) {
 		kfree(buffer);
 		return ERR_PTR(ret);
@@ -159,11 +170,8 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	return buffer;
 }
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_free(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
-	struct ion_device *dev = buffer->dev;
-
 	if (WARN_ON(buffer->kmap_cnt > 0))
 		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
 
@@ -171,10 +179,28 @@ static void ion_buffer_destroy(struct kref *kref)
 		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
 
 	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
+static void ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_device *dev = buffer->dev;
+	struct ion_heap *heap = buffer->heap;
+
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	/*
+	 * Unmapping and zeroing a large buffer can take milliseconds, so
+	 * heaps that allow it hand the work to their free thread rather than
+	 * making whoever dropped the last reference wait.
+	 */
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_free(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -618,52 +644,324 @@ end:
 	return handle;
 }
 
-static const struct file_operations ion_share_fops;
+static struct scatterlist *ion_buffer_dma_get(struct ion_buffer *buffer)
+{
+	struct ion_heap *heap = buffer->heap;
+	struct scatterlist *sglist;
 
-int ion_share_fd(struct ion_client *client, struct ion_handle *handle)
+	if (!heap->ops->map_dma)
+		return ERR_PTR(-ENODEV);
+
+	mutex_lock(&buffer->lock);
+	if (buffer->dmap_cnt) {
+		buffer->dmap_cnt++;
+		sglist = buffer->sglist;
+		goto out;
+	}
+	sglist = heap->ops->map_dma(heap, buffer);
+	if (IS_ERR_OR_NULL(sglist))
+		goto out;
+	buffer->sglist = sglist;
+	buffer->dmap_cnt++;
+out:
+	mutex_unlock(&buffer->lock);
+	return sglist ? sglist : ERR_PTR(-ENOMEM);
+}
+
+static void ion_buffer_dma_put(struct ion_buffer *buffer)
 {
-	int fd = get_unused_fd();
-	struct file *filp;
-	struct ion_buffer *buffer;
+	mutex_lock(&buffer->lock);
+	if (!--buffer->dmap_cnt) {
+		buffer->heap->ops->unmap_dma(buffer->heap, buffer);
+		buffer->sglist = NULL;
+	}
+	mutex_unlock(&buffer->lock);
+}
 
-	if (fd < 0)
-		return fd;
+static void *ion_buffer_kmap_get(struct ion_buffer *buffer)
+{
+	struct ion_heap *heap = buffer->heap;
+	void *vaddr;
+
+	if (!heap->ops->map_kernel)
+		return ERR_PTR(-ENODEV);
+
+	mutex_lock(&buffer->lock);
+	if (buffer->kmap_cnt) {
+		buffer->kmap_cnt++;
+		vaddr = buffer->vaddr;
+		goto out;
+	}
+	vaddr = heap->ops->map_kernel(heap, buffer);
+	if (IS_ERR_OR_NULL(vaddr))
+		goto out;
+	buffer->vaddr = vaddr;
+	buffer->kmap_cnt++;
+out:
+	mutex_unlock(&buffer->lock);
+	return vaddr ? vaddr : ERR_PTR(-ENOMEM);
+}
+
+static void ion_buffer_kmap_put(struct ion_buffer *buffer)
+{
+	mutex_lock(&buffer->lock);
+	if (!--buffer->kmap_cnt) {
+		buffer->heap->ops->unmap_kernel(buffer->heap, buffer);
+		buffer->vaddr = NULL;
+	}
+	mutex_unlock(&buffer->lock);
+}
+
+/*
+ * Cache maintenance for cpu access to [start, start + len) of a buffer.
+ * Only cached buffers need it; heaps without a scatterlist (carveout)
+ * only ever map their memory uncached.
+ */
+static void ion_buffer_sync(struct ion_buffer *buffer, size_t start,
+			    size_t len, enum dma_data_direction dir,
+			    bool for_cpu)
+{
+	struct scatterlist *sglist, *sg;
+	size_t offset = 0;
+
+	if (!ion_buffer_cached(buffer))
+		return;
+
+	sglist = ion_buffer_dma_get(buffer);
+	if (IS_ERR(sglist))
+		return;
+
+	for (sg = sglist; sg && offset < start + len;
+	     offset += sg->length, sg = sg_next(sg)) {
+		size_t from = max(start, offset);
+		size_t to = min(start + len, offset + sg->length);
+
+		if (from >= to)
+			continue;
+		if (for_cpu)
+			__dma_page_dev_to_cpu(sg_page(sg),
+					      sg->offset + from - offset,
+					      to - from, dir);
+		else
+			__dma_page_cpu_to_dev(sg_page(sg),
+					      sg->offset + from - offset,
+					      to - from, dir);
+	}
+
+	ion_buffer_dma_put(buffer);
+}
+
+/*
+ * Each attachment gets its own copy of the heap's scatterlist, mapped
+ * for the attaching device; the heap's list itself is shared by all of
+ * them and stays valid until the last one is unmapped.
+ */
+static struct sg_table *ion_map_dma_buf(struct dma_buf_attachment *attachment,
+					enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = attachment->dmabuf->priv;
+	struct scatterlist *sglist, *src, *sg;
+	struct sg_table *table;
+	int nents = 0;
+	int i, ret;
+
+	sglist = ion_buffer_dma_get(buffer);
+	if (IS_ERR(sglist))
+		return ERR_CAST(sglist);
+
+	for (src = sglist; src; src = sg_next(src))
+		nents++;
+
+	table = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+	if (!table) {
+		ret = -ENOMEM;
+		goto err_put;
+	}
+	ret = sg_alloc_table(table, nents, GFP_KERNEL);
+	if (ret)
+		goto err_free_table;
+
+	src = sglist;
+	for_each_sg(table->sgl, sg, table->nents, i) {
+		sg_set_page(sg, sg_page(src), src->length, src->offset);
+		src = sg_next(src);
+	}
+
+	if (!dma_map_sg(attachment->dev, table->sgl, table->nents,
+			direction)) {
+		ret = -ENOMEM;
+		goto err_free_sg;
+	}
+	return table;
+
+err_free_sg:
+	sg_free_table(table);
+err_free_table:
+	kfree(table);
+err_put:
+	ion_buffer_dma_put(buffer);
+	return ERR_PTR(ret);
+}
+
+static void ion_unmap_dma_buf(struct dma_buf_attachment *attachment,
+			      struct sg_table *table,
+			      enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = attachment->dmabuf->priv;
+
+	dma_unmap_sg(attachment->dev, table->sgl, table->nents, direction);
+	sg_free_table(table);
+	kfree(table);
+	ion_buffer_dma_put(buffer);
+}
+
+/* only used to recognise ion mappings in ion_import_uva */
+static struct vm_operations_struct ion_vm_ops;
+
+static int ion_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+	int ret;
+
+	if (!buffer->heap->ops->map_user) {
+		pr_err("%s: this heap does not define a method for mapping "
+		       "to userspace\n", __func__);
+		return -EINVAL;
+	}
+
+	mutex_lock(&buffer->lock);
+	/* now map it to userspace */
+	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+	mutex_unlock(&buffer->lock);
+	if (ret) {
+		pr_err("%s: failure mapping buffer to userspace\n",
+		       __func__);
+		return ret;
+	}
+
+	/* the dma_buf file pinned by the vma keeps the buffer alive */
+	vma->vm_ops = &ion_vm_ops;
+	vma->vm_private_data = buffer;
+	return 0;
+}
+
+static void ion_dma_buf_release(struct dma_buf *dmabuf)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	ion_buffer_put(buffer);
+}
+
+/*
+ * The kernel mapping is set up by begin_cpu_access and only valid until
+ * the matching end_cpu_access.
+ */
+static void *ion_dma_buf_kmap(struct dma_buf *dmabuf, unsigned long offset)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	return buffer->vaddr + offset * PAGE_SIZE;
+}
+
+static void ion_dma_buf_kunmap(struct dma_buf *dmabuf, unsigned long offset,
+			       void *ptr)
+{
+}
+
+static int ion_dma_buf_begin_cpu_access(struct dma_buf *dmabuf, size_t start,
+					size_t len,
+					enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+	void *vaddr;
+
+	vaddr = ion_buffer_kmap_get(buffer);
+	if (IS_ERR(vaddr))
+		return PTR_ERR(vaddr);
+
+	ion_buffer_sync(buffer, start, len, direction, true);
+	return 0;
+}
+
+static void ion_dma_buf_end_cpu_access(struct dma_buf *dmabuf, size_t start,
+				       size_t len,
+				       enum dma_data_direction direction)
+{
+	struct ion_buffer *buffer = dmabuf->priv;
+
+	ion_buffer_sync(buffer, start, len, direction, false);
+	ion_buffer_kmap_put(buffer);
+}
+
+static struct dma_buf_ops dma_buf_ops = {
+	.map_dma_buf = ion_map_dma_buf,
+	.unmap_dma_buf = ion_unmap_dma_buf,
+	.mmap = ion_mmap,
+	.release = ion_dma_buf_release,
+	.begin_cpu_access = ion_dma_buf_begin_cpu_access,
+	.end_cpu_access = ion_dma_buf_end_cpu_access,
+	.kmap_atomic = ion_dma_buf_kmap,
+	.kunmap_atomic = ion_dma_buf_kunmap,
+	.kmap = ion_dma_buf_kmap,
+	.kunmap = ion_dma_buf_kunmap,
+};
+
+struct dma_buf *ion_share_dma_buf(struct ion_client *client,
+				  struct ion_handle *handle)
+{
+	struct ion_buffer *buffer;
+	struct dma_buf *dmabuf;
 
 	buffer = ion_share(client, handle);
 	if (IS_ERR(buffer))
-		goto err;
-
-	filp = anon_inode_getfile("ion_share_fd", &ion_share_fops, buffer,
-				O_RDWR);
-	if (IS_ERR_OR_NULL(filp))
-		goto err;
+		return ERR_CAST(buffer);
 
+	/* the dma_buf holds a reference until its release op runs */
 	ion_buffer_get(buffer);
-	fd_install(fd, filp);
+	dmabuf = dma_buf_export(buffer, &dma_buf_ops, buffer->size, O_RDWR);
+	if (IS_ERR(dmabuf))
+		ion_buffer_put(buffer);
+	return dmabuf;
+}
+
+int ion_share_fd(struct ion_client *client, struct ion_handle *handle)
+{
+	struct dma_buf *dmabuf;
+	int fd;
+
+	dmabuf = ion_share_dma_buf(client, handle);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	fd = dma_buf_fd(dmabuf, 0);
+	if (fd < 0)
+		dma_buf_put(dmabuf);
 	return fd;
-err:
-	put_unused_fd(fd);
-	return -ENFILE;
+}
+
+struct ion_handle *ion_import_dma_buf(struct ion_client *client,
+				      struct dma_buf *dmabuf)
+{
+	if (dmabuf->ops != &dma_buf_ops) {
+		pr_err("%s: can not import dmabuf from another exporter\n",
+		       __func__);
+		return ERR_PTR(-EINVAL);
+	}
+	return ion_import(client, dmabuf->priv);
 }
 
 struct ion_handle *ion_import_fd(struct ion_client *client, int fd)
 {
-	struct file *file = fget(fd);
+	struct dma_buf *dmabuf;
 	struct ion_handle *handle;
 
-	if (!file) {
-		pr_err("%s: imported fd not found in file table.\n", __func__);
-		return ERR_PTR(-EINVAL);
-	}
-	if (file->f_op != &ion_share_fops) {
-		pr_err("%s: imported file is not a shared ion file.\n",
-		       __func__);
-		handle = ERR_PTR(-EINVAL);
-		goto end;
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf)) {
+		pr_err("%s: imported fd is not a dma_buf.\n", __func__);
+		return ERR_CAST(dmabuf);
 	}
-	handle = ion_import(client, file->private_data);
-end:
-	fput(file);
+	handle = ion_import_dma_buf(client, dmabuf);
+	dma_buf_put(dmabuf);
 	return handle;
 }
 
@@ -684,13 +982,13 @@ struct ion_handle *ion_import_uva(struct ion_client *client, unsigned long uva,
 		return ERR_PTR(-ENXIO);
 	}
 
-	if (vma->vm_file->f_op != &ion_share_fops) {
-		pr_debug("%s: imported file is not a shared ion file.\n",
+	if (vma->vm_ops != &ion_vm_ops) {
+		pr_debug("%s: imported address is not an ion mapping.\n",
 		__func__);
 		return ERR_PTR(-ENXIO);
 	}
 
-	handle = ion_import(client, vma->vm_file->private_data);
+	handle = ion_import(client, vma->vm_private_data);
 	if (IS_ERR(handle))
 		return handle;
 
@@ -942,179 +1240,6 @@ void ion_put_user_client(struct ion_client *user_client)
 	ion_client_put(user_client);
 }
 
-static int ion_share_release(struct inode *inode, struct file* file)
-{
-	struct ion_buffer *buffer = file->private_data;
-
-	pr_debug("%s: %d\n", __func__, __LINE__);
-	/* drop the reference to the buffer -- this prevents the
-	   buffer from going away because the client holding it exited
-	   while it was being passed */
-	ion_buffer_put(buffer);
-	return 0;
-}
-
-static void ion_vma_open(struct vm_area_struct *vma)
-{
-
-	struct ion_buffer *buffer = vma->vm_file->private_data;
-	struct ion_handle *handle = vma->vm_private_data;
-	struct ion_client *client;
-
-	pr_debug("%s: %d\n", __func__, __LINE__);
-	/* check that the client still exists and take a reference so
-	   it can't go away until this vma is closed */
-	client = ion_client_lookup(buffer->dev, current->group_leader);
-	if (IS_ERR_OR_NULL(client)) {
-		vma->vm_private_data = NULL;
-		return;
-	}
-
-	if (!ion_handle_validate(client, handle)) {
-		ion_client_put(client);
-		vma->vm_private_data = NULL;
-		return;
-	}
-
-	ion_handle_get(handle);
-
-	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
-		 __func__, __LINE__,
-		 atomic_read(&client->ref.refcount),
-		 atomic_read(&handle->ref.refcount),
-		 atomic_read(&buffer->ref.refcount));
-}
-
-static void ion_vma_close(struct vm_area_struct *vma)
-{
-	struct ion_handle *handle = vma->vm_private_data;
-	struct ion_buffer *buffer = vma->vm_file->private_data;
-	struct ion_client *client;
-
-	pr_debug("%s: %d\n", __func__, __LINE__);
-	/* this indicates the client is gone, nothing to do here */
-	if (!handle)
-		return;
-	client = handle->client;
-	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
-		 __func__, __LINE__,
-		 atomic_read(&client->ref.refcount),
-		 atomic_read(&handle->ref.refcount),
-		 atomic_read(&buffer->ref.refcount));
-	ion_handle_put(handle);
-	ion_client_put(client);
-	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
-		 __func__, __LINE__,
-		 atomic_read(&client->ref.refcount),
-		 atomic_read(&handle->ref.refcount),
-		 atomic_read(&buffer->ref.refcount));
-}
-
-static struct vm_operations_struct ion_vm_ops = {
-	.open = ion_vma_open,
-	.close = ion_vma_close,
-};
-
-static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
-{
-	struct ion_buffer *buffer = file->private_data;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	struct ion_client *client;
-	struct ion_handle *handle;
-	int ret;
-
-	pr_debug("%s: %d\n", __func__, __LINE__);
-	/* make sure the client still exists, it's possible for the client to
-	   have gone away but the map/share fd still to be around, take
-	   a reference to it so it can't go away while this mapping exists */
-	client = ion_client_lookup(buffer->dev, current->group_leader);
-	if (IS_ERR_OR_NULL(client)) {
-		pr_err("%s: trying to mmap an ion handle in a process with no "
-		       "ion client\n", __func__);
-		return -EINVAL;
-	}
-
-	if (((vma->vm_pgoff << PAGE_SHIFT) >= buffer->size) ||
-		(size > (buffer->size - (vma->vm_pgoff << PAGE_SHIFT)))) {
-		pr_err("%s: trying to map larger area than handle has available"
-		       "\n", __func__);
-		ret = -EINVAL;
-		goto err;
-	}
-
-	/* find the handle and take a reference to it */
-	handle = ion_import(client, buffer);
-	if (IS_ERR_OR_NULL(handle)) {
-		ret = -EINVAL;
-		goto err;
-	}
-
-	if (!handle->buffer->heap->ops->map_user) {
-		pr_err("%s: this heap does not define a method for mapping "
-		       "to userspace\n", __func__);
-		ret = -EINVAL;
-		goto err1;
-	}
-
-	mutex_lock(&buffer->lock);
-	/* now map it to userspace */
-	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
-	mutex_unlock(&buffer->lock);
-	if (ret) {
-		pr_err("%s: failure mapping buffer to userspace\n",
-		       __func__);
-		goto err1;
-	}
-
-	vma->vm_ops = &ion_vm_ops;
-	/* move the handle into the vm_private_data so we can access it from
-	   vma_open/close */
-	vma->vm_private_data = handle;
-	pr_debug("%s: %d client_cnt %d handle_cnt %d alloc_cnt %d\n",
-		 __func__, __LINE__,
-		 atomic_read(&client->ref.refcount),
-		 atomic_read(&handle->ref.refcount),
-		 atomic_read(&buffer->ref.refcount));
-	return 0;
-
-err1:
-	/* drop the reference to the handle */
-	ion_handle_put(handle);
-err:
-	/* drop the reference to the client */
-	ion_client_put(client);
-	return ret;
-}
-
-static const struct file_operations ion_share_fops = {
-	.owner		= THIS_MODULE,
-	.release	= ion_share_release,
-	.mmap		= ion_share_mmap,
-};
-
-static int ion_ioctl_share(struct file *parent, struct ion_client *client,
-			   struct ion_handle *handle)
-{
-	int fd = get_unused_fd();
-	struct file *file;
-
-	if (fd < 0)
-		return fd;
-
-	file = anon_inode_getfile("ion_share_fd", &ion_share_fops,
-				  handle->buffer, O_RDWR);
-	if (IS_ERR_OR_NULL(file))
-		goto err;
-	ion_buffer_get(handle->buffer);
-	fd_install(fd, file);
-
-	return fd;
-
-err:
-	put_unused_fd(fd);
-	return -ENFILE;
-}
-
 static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct ion_client *client = filp->private_data;
@@ -1168,8 +1293,10 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			mutex_unlock(&client->lock);
 			return -EINVAL;
 		}
-		data.fd = ion_ioctl_share(filp, client, data.handle);
 		mutex_unlock(&client->lock);
+		data.fd = ion_share_fd(client, data.handle);
+		if (data.fd < 0)
+			return data.fd;
 		if (copy_to_user((void __user *)arg, &data, sizeof(data)))
 			return -EFAULT;
 		break;
@@ -1189,6 +1316,30 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			return -EFAULT;
 		break;
 	}
+	case ION_IOC_DRAIN:
+	{
+		struct ion_device *dev = client->dev;
+		struct rb_node *n;
+
+		/*
+		 * Don't hold dev->lock while waiting for the free threads, or
+		 * every allocation and free on the device waits with us.  Heaps
+		 * are never removed, so n stays in the tree while unlocked.
+		 */
+		mutex_lock(&dev->lock);
+		for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
+			struct ion_heap *heap = rb_entry(n, struct ion_heap,
+							 node);
+
+			if (!((1 << heap->type) & client->heap_mask))
+				continue;
+			mutex_unlock(&dev->lock);
+			ion_heap_freelist_wait(heap);
+			mutex_lock(&dev->lock);
+		}
+		mutex_unlock(&dev->lock);
+		break;
+	}
 	case ION_IOC_CUSTOM:
 	{
 		struct ion_device *dev = client->dev;
@@ -1285,6 +1436,24 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE) {
+		size_t pending, peak;
+		u64 deferred, drained;
+
+		spin_lock(&heap->free_lock);
+		pending = heap->free_list_size;
+		peak = heap->free_list_peak;
+		deferred = heap->nr_deferred;
+		drained = heap->nr_drained;
+		spin_unlock(&heap->free_lock);
+
+		seq_printf(s, "\ndeferred free:\n");
+		seq_printf(s, "%16.s %16u\n", "pending", pending);
+		seq_printf(s, "%16.s %16u\n", "peak", peak);
+		seq_printf(s, "%16.s %16llu\n", "buffers", deferred);
+		seq_printf(s, "%16.s %16llu\n", "drained", drained);
+	}
 	return 0;
 }
 
@@ -1323,6 +1492,9 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		}
 	}
 
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_init_deferred_free(heap);
+
 	rb_link_node(&heap->node, parent, p);
 	rb_insert_color(&heap->node, &dev->heaps);
 	debugfs_create_file(heap->name, 0664, dev->debug_root, heap,
@@ -20,7 +20,11 @@
 #include <linux/kref.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
+#include <linux/plist.h>
 #include <linux/rbtree.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/ion.h>
 
 struct ion_mapping;
@@ -54,6 +58,7 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @list:		element in the heap's deferred free list
 */
 struct ion_buffer {
 	struct kref ref;
@@ -71,8 +76,34 @@ struct ion_buffer {
 	void *vaddr;
 	int dmap_cnt;
 	struct scatterlist *sglist;
+	struct list_head list;
 };
 
+/**
+ * ion_buffer_free - release a buffer's memory and metadata
+ * @buffer:		the buffer, already removed from the device tree
+ *
+ * Called when the last reference is dropped, or later from the heap's
+ * deferred free thread if the heap has ION_HEAP_FLAG_DEFER_FREE set.
+ */
+void ion_buffer_free(struct ion_buffer *buffer);
+
+/**
+ * ion_buffer_cached - whether mappings of the buffer may be cached
+ * @buffer:		the buffer
+ *
+ * Only Exynos clients can currently ask for an uncached (write-combined)
+ * buffer, everything else is mapped cached.
+ */
+static inline bool ion_buffer_cached(struct ion_buffer *buffer)
+{
+#ifdef CONFIG_ION_EXYNOS
+	return !(buffer->flags & ION_EXYNOS_NONCACHE_MASK);
+#else
+	return true;
+#endif
+}
+
 /**
  * struct ion_heap_ops - ops to operate on a given heap
  * @allocate:		allocate memory
@@ -101,6 +132,11 @@ struct ion_heap_ops {
 			 struct vm_area_struct *vma);
 };
 
+/**
+ * heap flags - flags between the heaps and core ion code
+ */
+#define ION_HEAP_FLAG_DEFER_FREE (1 << 0)
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
@@ -111,6 +147,17 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @flags:		flags, see ION_HEAP_FLAG_*
+ * @free_list:		buffers waiting for the deferred free thread
+ * @free_list_size:	bytes queued on free_list or still being freed
+ * @free_list_peak:	high watermark of free_list_size
+ * @free_lock:		protects the free list, its size and the counters
+ * @waitqueue:		wakes the deferred free thread, and drainers waiting
+ *			for free_list_size to reach zero
+ * @task:		the deferred free thread
+ * @nr_deferred:	buffers handed to the deferred free list
+ * @nr_drained:		of those, buffers freed by a drain instead of
+ *			the thread
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -124,6 +171,15 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	size_t free_list_peak;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	u64 nr_deferred;
+	u64 nr_drained;
 };
 
 /**
@@ -159,6 +215,53 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * ion_heap_init_deferred_free -- initialize deferred free functionality
+ * @heap:		the heap
+ *
+ * Starts the low priority thread that frees buffers queued on the heap's
+ * free list.  Called from ion_device_add_heap for heaps that set
+ * ION_HEAP_FLAG_DEFER_FREE; on failure the flag is cleared and buffers
+ * are freed synchronously again.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_add - add a buffer to the deferred free list
+ * @heap:		the heap
+ * @buffer:		the buffer
+ *
+ * Adds an item to the deferred freelist and wakes the free thread.
+ */
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+
+/**
+ * ion_heap_freelist_drain - free buffers on the deferred free list
+ * @heap:		the heap
+ * @size:		amount of memory to drain in bytes, 0 for everything
+ *
+ * Frees buffers from the free list in the caller's context, for when the
+ * memory is needed now (an allocation failed, or the shrinker runs).
+ * Returns the number of bytes drained.
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap, size_t size);
+
+/**
+ * ion_heap_freelist_wait - drain the free list and wait for it to empty
+ * @heap:		the heap
+ *
+ * Unlike ion_heap_freelist_drain, also waits for the buffer the free
+ * thread may be working on, so all memory queued before the call has been
+ * returned to the heap once this returns.
+ */
+void ion_heap_freelist_wait(struct ion_heap *heap);
+
+/**
+ * ion_heap_freelist_size - bytes queued for deferred freeing
+ * @heap:		the heap
+ */
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -181,4 +284,50 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @high_count:		number of highmem items in the pool
+ * @low_count:		number of lowmem items in the pool
+ * @high_items:		list of highmem items
+ * @low_items:		list of lowmem items
+ * @mutex:		lock protecting this struct and especially the count
+ *			item list
+ * @gfp_mask:		gfp_mask to use from alloc
+ * @order:		order of pages in the pool
+ * @list:		plist node for list of pools
+ *
+ * Allows you to keep a pool of pre allocated pages to use from your heap.
+ * Keeping a pool of pages that is ready for dma, ie any cached mapping have
+ * been invalidated from the cache, provides a significant peformance benefit
+ * on many systems.  Pages are linked through page->lru while pooled, so
+ * returning a page to the pool never allocates.
+ */
+struct ion_page_pool {
+	int high_count;
+	int low_count;
+	struct list_head high_items;
+	struct list_head low_items;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+	struct plist_node list;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+void *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
+/**
+ * ion_page_pool_shrink - shrinks the size of the memory cached in the pool
+ * @pool:		the pool
+ * @gfp_mask:		the memory type to reclaim
+ * @nr_to_scan:		number of items to shrink in pages
+ *
+ * returns the number of items freed in pages, or if nr_to_scan is 0 the
+ * number of pages that could be freed
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
+			  int nr_to_scan);
+
 #endif /* _ION_PRIV_H */
@@ -56,6 +56,8 @@
 #include <linux/file.h>
 #include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
@@ -216,6 +218,37 @@ static inline void binder_stats_created(enum binder_stat_types type)
 	atomic_inc(&binder_stats.obj_created[type]);
 }
 
+/*
+ * Latency histograms, kept globally and per proc and node. Bucket 0
+ * counts samples under 1us, bucket i samples in [2^(i-1), 2^i) us and
+ * the last bucket everything above. Collection is off by default and
+ * is switched on through the latency_enable debugfs file; while off,
+ * the hooks cost a single patched-out branch. The per-proc and per-node
+ * histograms are only allocated when the first sample is accounted to
+ * them, so procs and nodes that never see one pay a single pointer.
+ */
+enum binder_latency_types {
+	BINDER_LATENCY_PICKUP,	/* submit to target thread pickup */
+	BINDER_LATENCY_REPLY,	/* pickup to BC_REPLY */
+	BINDER_LATENCY_ALLOC,	/* binder_alloc_new_buf() */
+	BINDER_LATENCY_COUNT
+};
+
+#define BINDER_LATENCY_BUCKETS	24
+
+struct binder_latency {
+	atomic_t hist[BINDER_LATENCY_COUNT][BINDER_LATENCY_BUCKETS];
+};
+
+static struct binder_latency binder_latency;
+static struct static_key binder_latency_key = STATIC_KEY_INIT_FALSE;
+static DEFINE_MUTEX(binder_latency_lock);
+
+static inline bool binder_latency_on(void)
+{
+	return static_key_false(&binder_latency_key);
+}
+
 struct binder_transaction_log_entry {
 	int debug_id;
 	int debug_id_done;
@@ -361,6 +394,9 @@ struct binder_error {
  *                        (invariant after initialized)
  * @async_todo:           list of async work items
  *                        (protected by @proc->inner_lock)
+ * @latency:              histograms for transactions to this node,
+ *                        allocated on first sample
+ *                        (set once with cmpxchg, atomics, no lock needed)
  *
  * Bookkeeping structure for binder nodes.
  */
@@ -402,6 +438,7 @@ struct binder_node {
 	};
 	bool has_async_transaction;
 	struct list_head async_todo;
+	struct binder_latency *latency;
 };
 
 struct binder_ref_death {
@@ -533,6 +570,9 @@ struct binder_priority {
  * @default_priority:     default scheduler priority
  *                        (invariant after initialized)
  * @debugfs_entry:        debugfs node
+ * @latency:              per-process latency histograms,
+ *                        allocated on first sample
+ *                        (set once with cmpxchg, atomics, no lock needed)
  * @alloc:                binder allocator bookkeeping
  * @context:              binder_context for this proc
  *                        (invariant after initialized)
@@ -566,6 +606,7 @@ struct binder_proc {
 	int tmp_ref;
 	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_latency *latency;
 	struct binder_alloc alloc;
 	struct binder_context *context;
 	spinlock_t inner_lock;
@@ -656,6 +697,14 @@ struct binder_transaction {
 	bool    set_priority_called;
 	kuid_t	sender_euid;
 	binder_uintptr_t security_ctx;
+	/*
+	 * Only set while latency stats are enabled. @lat_node holds a
+	 * tmpref on the target node from pickup until the transaction
+	 * is freed, so the reply can be accounted to it.
+	 */
+	ktime_t	submit_time;
+	ktime_t	pickup_time;
+	struct binder_node *lat_node;
 	/**
 	 * @lock:  protects @from, @to_proc, and @to_thread
 	 *
@@ -835,6 +884,47 @@ binder_enqueue_work_ilocked(struct binder_work *work,
 	list_add_tail(&work->entry, target_list);
 }
 
+/**
+ * binder_enqueue_proc_transaction_ilocked() - Queue a transaction to proc
+ * @t:            transaction to queue
+ * @proc:         process to queue @t to
+ *
+ * Used when no thread in @proc is waiting to take @t. A synchronous
+ * transaction is queued ahead of synchronous transactions with a lower
+ * priority at the tail of @proc->todo, so the next thread to come free
+ * serves the most urgent caller first instead of the oldest one. @t
+ * never passes any other kind of work or an async transaction, which
+ * keeps the ordering that userspace relies on for those intact.
+ *
+ * Requires the proc->inner_lock to be held.
+ */
+static void
+binder_enqueue_proc_transaction_ilocked(struct binder_transaction *t,
+					struct binder_proc *proc)
+{
+	struct list_head *pos = &proc->todo;
+	struct binder_work *w;
+
+	if (t->flags & TF_ONE_WAY) {
+		binder_enqueue_work_ilocked(&t->work, &proc->todo);
+		return;
+	}
+
+	list_for_each_entry_reverse(w, &proc->todo, entry) {
+		struct binder_transaction *queued;
+
+		if (w->type != BINDER_WORK_TRANSACTION)
+			break;
+		queued = container_of(w, struct binder_transaction, work);
+		if ((queued->flags & TF_ONE_WAY) ||
+		    queued->priority.prio <= t->priority.prio)
+			break;
+		pos = &w->entry;
+	}
+	/* inserts before @pos, i.e. at the tail if nothing was passed */
+	binder_enqueue_work_ilocked(&t->work, pos);
+}
+
 /**
  * binder_enqueue_deferred_thread_work_ilocked() - Add deferred thread work
  * @thread:       thread to queue work to
@@ -1399,6 +1489,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 
 static void binder_free_node(struct binder_node *node)
 {
+	kfree(node->latency);
 	kfree(node);
 	binder_stats_deleted(BINDER_STAT_NODE);
 }
@@ -2116,10 +2207,68 @@ static struct binder_thread *binder_get_txn_from_and_acq_inner(
 	return NULL;
 }
 
+/**
+ * binder_latency_get() - get a per-proc or per-node histogram
+ * @latp:	pointer to the proc or node histogram pointer
+ *
+ * Allocates the histogram the first time a sample is accounted to it.
+ * Callers may hold spinlocks, so the allocation does not sleep; if it
+ * fails the sample is only accounted globally.
+ *
+ * Return: the histogram, or NULL if it could not be allocated
+ */
+static struct binder_latency *binder_latency_get(struct binder_latency **latp)
+{
+	struct binder_latency *lat = ACCESS_ONCE(*latp);
+
+	if (lat)
+		return lat;
+	lat = kzalloc(sizeof(*lat), GFP_NOWAIT | __GFP_NOWARN);
+	if (!lat)
+		return NULL;
+	if (cmpxchg(latp, NULL, lat) != NULL) {
+		kfree(lat);
+		lat = ACCESS_ONCE(*latp);
+	}
+	return lat;
+}
+
+/**
+ * binder_latency_add() - account a latency sample
+ * @type:	histogram to update
+ * @start:	start of the measured interval
+ * @end:	end of the measured interval
+ * @proc:	binder_proc to account the sample to
+ * @node:	binder_node to account the sample to (may be NULL)
+ */
+static void binder_latency_add(enum binder_latency_types type,
+			       ktime_t start, ktime_t end,
+			       struct binder_proc *proc,
+			       struct binder_node *node)
+{
+	struct binder_latency *lat;
+	s64 us = ktime_us_delta(end, start);
+	int bucket = 0;
+
+	if (us > 0)
+		bucket = min_t(int, fls64(us), BINDER_LATENCY_BUCKETS - 1);
+	atomic_inc(&binder_latency.hist[type][bucket]);
+	lat = binder_latency_get(&proc->latency);
+	if (lat)
+		atomic_inc(&lat->hist[type][bucket]);
+	if (node) {
+		lat = binder_latency_get(&node->latency);
+		if (lat)
+			atomic_inc(&lat->hist[type][bucket]);
+	}
+}
+
 static void binder_free_transaction(struct binder_transaction *t)
 {
 	if (t->buffer)
 		t->buffer->transaction = NULL;
+	if (t->lat_node)
+		binder_dec_node_tmpref(t->lat_node);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -2819,7 +2968,7 @@ static bool binder_proc_transaction(struct binder_transaction *t,
 					    node->inherit_rt);
 		binder_enqueue_thread_work_ilocked(thread, &t->work);
 	} else if (!pending_async) {
-		binder_enqueue_work_ilocked(&t->work, &proc->todo);
+		binder_enqueue_proc_transaction_ilocked(t, proc);
 	} else {
 		binder_enqueue_work_ilocked(&t->work, &node->async_todo);
 	}
@@ -3148,6 +3297,8 @@ static void binder_transaction(struct binder_proc *proc,
 
 	trace_binder_transaction(reply, t, target_node);
 
+	if (binder_latency_on())
+		t->submit_time = ktime_get();
 	t->buffer = binder_alloc_new_buf(&target_proc->alloc, tr->data_size,
 		tr->offsets_size, extra_buffers_size,
 		!reply && (t->flags & TF_ONE_WAY));
@@ -3162,6 +3313,9 @@ static void binder_transaction(struct binder_proc *proc,
 		t->buffer = NULL;
 		goto err_binder_alloc_buf_failed;
 	}
+	if (ktime_to_ns(t->submit_time))
+		binder_latency_add(BINDER_LATENCY_ALLOC, t->submit_time,
+				   ktime_get(), target_proc, target_node);
 	if (secctx) {
 		size_t buf_offset = ALIGN(tr->data_size, sizeof(void *)) +
 				    ALIGN(tr->offsets_size, sizeof(void *)) +
@@ -3387,6 +3541,10 @@ static void binder_transaction(struct binder_proc *proc,
 		binder_inner_proc_unlock(target_proc);
 		wake_up_interruptible_sync(&target_thread->wait);
 		binder_restore_priority(current, in_reply_to->saved_priority);
+		if (ktime_to_ns(in_reply_to->pickup_time))
+			binder_latency_add(BINDER_LATENCY_REPLY,
+					   in_reply_to->pickup_time, ktime_get(),
+					   proc, in_reply_to->lat_node);
 		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -4303,6 +4461,12 @@ retry:
 			node_prio.prio = target_node->min_priority;
 			binder_transaction_priority(current, t, node_prio,
 						    target_node->inherit_rt);
+			if (ktime_to_ns(t->submit_time)) {
+				t->pickup_time = ktime_get();
+				binder_latency_add(BINDER_LATENCY_PICKUP,
+						   t->submit_time, t->pickup_time,
+						   proc, target_node);
+			}
 			cmd = BR_TRANSACTION;
 		} else {
 			trd->target.ptr = 0;
@@ -4377,6 +4541,10 @@ retry:
 			binder_thread_dec_tmpref(t_from);
 		t->buffer->allow_user_free = 1;
 		if (cmd != BR_REPLY && !(t->flags & TF_ONE_WAY)) {
+			if (ktime_to_ns(t->pickup_time)) {
+				t->lat_node = t->buffer->target_node;
+				binder_inc_node_tmpref(t->lat_node);
+			}
 			binder_inner_proc_lock(thread->proc);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
@@ -4532,6 +4700,7 @@ static void binder_free_proc(struct binder_proc *proc)
 	binder_alloc_deferred_release(&proc->alloc);
 	put_task_struct(proc->tsk);
 	binder_stats_deleted(BINDER_STAT_PROC);
+	kfree(proc->latency);
 	kfree(proc);
 }
 
@@ -5673,6 +5842,51 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	}
 }
 
+static const char * const binder_latency_strings[] = {
+	"pickup",
+	"reply",
+	"alloc"
+};
+
+static bool binder_latency_empty(struct binder_latency *lat)
+{
+	int i, j;
+
+	if (!lat)
+		return true;
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++)
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++)
+			if (atomic_read(&lat->hist[i][j]))
+				return false;
+	return true;
+}
+
+static void print_binder_latency(struct seq_file *m, const char *prefix,
+				 struct binder_latency *lat)
+{
+	int hist[BINDER_LATENCY_BUCKETS];
+	int i, j, last;
+
+	BUILD_BUG_ON(ARRAY_SIZE(lat->hist) !=
+		     ARRAY_SIZE(binder_latency_strings));
+	if (!lat)
+		return;
+	for (i = 0; i < ARRAY_SIZE(lat->hist); i++) {
+		last = -1;
+		for (j = 0; j < BINDER_LATENCY_BUCKETS; j++) {
+			hist[j] = atomic_read(&lat->hist[i][j]);
+			if (hist[j])
+				last = j;
+		}
+		if (last < 0)
+			continue;
+		seq_printf(m, "%s%s:", prefix, binder_latency_strings[i]);
+		for (j = 0; j <= last; j++)
+			seq_printf(m, " %d", hist[j]);
+		seq_puts(m, "\n");
+	}
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
@@ -5735,6 +5949,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
+	print_binder_latency(m, "  latency ", ACCESS_ONCE(proc->latency));
 }
 
 
@@ -5786,6 +6001,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	print_binder_latency(m, "latency ", &binder_latency);
 
 	mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
@@ -5809,6 +6025,64 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+
+	seq_printf(m, "binder latency (%s, bucket 0 < 1us, bucket n < 2^n us):\n",
+		   static_key_enabled(&binder_latency_key) ?
+		   "enabled" : "disabled");
+	print_binder_latency(m, "", &binder_latency);
+
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		struct binder_latency *lat = ACCESS_ONCE(proc->latency);
+
+		if (binder_latency_empty(lat))
+			continue;
+		seq_printf(m, "proc %d\n", proc->pid);
+		print_binder_latency(m, "  ", lat);
+		binder_inner_proc_lock(proc);
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			struct binder_node *node = rb_entry(n, struct binder_node,
+							    rb_node);
+
+			lat = ACCESS_ONCE(node->latency);
+			if (binder_latency_empty(lat))
+				continue;
+			seq_printf(m, "  node %d: u%016llx c%016llx\n",
+				   node->debug_id, (u64)node->ptr,
+				   (u64)node->cookie);
+			print_binder_latency(m, "    ", lat);
+		}
+		binder_inner_proc_unlock(proc);
+	}
+	mutex_unlock(&binder_procs_lock);
+
+	return 0;
+}
+
+static int binder_latency_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&binder_latency_key);
+	return 0;
+}
+
+static int binder_latency_enable_set(void *data, u64 val)
+{
+	mutex_lock(&binder_latency_lock);
+	if (val && !static_key_enabled(&binder_latency_key))
+		static_key_slow_inc(&binder_latency_key);
+	else if (!val && static_key_enabled(&binder_latency_key))
+		static_key_slow_dec(&binder_latency_key);
+	mutex_unlock(&binder_latency_lock);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(binder_latency_enable_fops, binder_latency_enable_get,
+			binder_latency_enable_set, "%llu\n");
+
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *itr;
@@ -5889,6 +6163,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init init_binder_device(const char *name)
 {
@@ -5964,6 +6239,16 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
+		debugfs_create_file("latency_enable",
+				    S_IRUGO | S_IWUSR,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_enable_fops);
 	}
 
 	/*
@@ -46,6 +46,14 @@ static uint32_t binder_alloc_debug_mask;
 module_param_named(debug_mask, binder_alloc_debug_mask,
 		   uint, S_IWUSR | S_IRUGO);
 
+/* Zeroed pages each busy proc keeps ready for populating its buffer */
+unsigned int binder_alloc_reserve_pages = 4;
+module_param_named(reserve_pages, binder_alloc_reserve_pages,
+		   uint, S_IWUSR | S_IRUGO);
+
+/* Missing pages are mapped in runs of at most this many pages */
+#define BINDER_ALLOC_MAP_BATCH	16
+
 #define binder_alloc_debug(mask, x...) \
 	do { \
 		if (binder_alloc_debug_mask & mask) \
@@ -184,15 +192,101 @@ struct binder_buffer *binder_alloc_prepare_to_free(struct binder_alloc *alloc,
 	return buffer;
 }
 
+/**
+ * binder_alloc_get_page() - get a zeroed page to populate the buffer with
+ * @alloc:	binder_alloc for this proc
+ *
+ * Takes a page from the warm reserve if there is one, otherwise falls
+ * back to the page allocator. Called with @alloc->mutex held.
+ *
+ * Return:	the page or NULL on allocation failure
+ */
+static struct page *binder_alloc_get_page(struct binder_alloc *alloc)
+{
+	struct page *page;
+
+	if (!list_empty(&alloc->reserve)) {
+		page = list_first_entry(&alloc->reserve, struct page, lru);
+		list_del(&page->lru);
+		alloc->reserve_count--;
+		alloc->reserve_hits++;
+		return page;
+	}
+	alloc->reserve_misses++;
+	alloc->reserve_cold++;
+	return alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
+}
+
+/**
+ * binder_alloc_reserve_fill() - top up the warm page reserve
+ * @alloc:	binder_alloc for this proc
+ *
+ * Only procs that had to allocate at least a reserve's worth of cold
+ * pages since the last refill get topped up, so the reserve ends up on
+ * services that actually take large or frequent incoming transactions.
+ * Called off the sender's path, with @alloc->mutex held.
+ */
+static void binder_alloc_reserve_fill(struct binder_alloc *alloc)
+{
+	unsigned int target = READ_ONCE(binder_alloc_reserve_pages);
+	struct page *page;
+
+	while (alloc->reserve_count > target) {
+		page = list_first_entry(&alloc->reserve, struct page, lru);
+		list_del(&page->lru);
+		__free_page(page);
+		alloc->reserve_count--;
+	}
+	if (!target || alloc->reserve_cold < target || !alloc->vma)
+		return;
+
+	alloc->reserve_cold = 0;
+	while (alloc->reserve_count < target) {
+		page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO |
+				  __GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			break;
+		list_add(&page->lru, &alloc->reserve);
+		alloc->reserve_count++;
+	}
+}
+
+static void binder_free_page_range(struct binder_alloc *alloc,
+				   void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *page;
+
+	for (page_addr = end - PAGE_SIZE; page_addr >= start;
+	     page_addr -= PAGE_SIZE) {
+		bool ret;
+		size_t index;
+
+		index = (page_addr - alloc->buffer) / PAGE_SIZE;
+		page = &alloc->pages[index];
+
+		trace_binder_free_lru_start(alloc, index);
+
+		ret = list_lru_add(&binder_alloc_lru, &page->lru);
+		WARN_ON(!ret);
+
+		trace_binder_free_lru_end(alloc, index);
+	}
+}
+
 static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
 				    void *start, void *end)
 {
-	void *page_addr;
+	struct page *pages[BINDER_ALLOC_MAP_BATCH];
+	void *page_addr, *run_start = NULL;
 	unsigned long user_page_addr;
 	struct binder_lru_page *page;
 	struct vm_area_struct *vma = NULL;
 	struct mm_struct *mm = NULL;
 	bool need_mm = false;
+	size_t index;
+	int nr = 0, i = 0;
+	int ret;
 
 	binder_alloc_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "%d: %s pages %pK-%pK\n", alloc->pid,
@@ -203,8 +297,10 @@ static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
 
 	trace_binder_update_page_range(alloc, allocate, start, end);
 
-	if (allocate == 0)
-		goto free_range;
+	if (allocate == 0) {
+		binder_free_page_range(alloc, start, end);
+		return 0;
+	}
 
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		page = &alloc->pages[(page_addr - alloc->buffer) / PAGE_SIZE];
@@ -229,10 +325,9 @@ static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
+	page_addr = start;
+	while (page_addr < end) {
 		bool on_lru;
-		size_t index;
 
 		index = (page_addr - alloc->buffer) / PAGE_SIZE;
 		page = &alloc->pages[index];
@@ -244,81 +339,83 @@ static int binder_update_page_range(struct binder_alloc *alloc, int allocate,
 			WARN_ON(!on_lru);
 
 			trace_binder_alloc_lru_end(alloc, index);
+			page_addr += PAGE_SIZE;
 			continue;
 		}
 
 		if (WARN_ON(!vma))
 			goto err_page_ptr_cleared;
 
-		trace_binder_alloc_page_start(alloc, index);
-		page->page_ptr = alloc_page(GFP_KERNEL |
-					    __GFP_HIGHMEM |
-					    __GFP_ZERO);
-		if (!page->page_ptr) {
-			pr_err("%d: binder_alloc_buf failed for page at %pK\n",
-				alloc->pid, page_addr);
-			goto err_alloc_page_failed;
+		/*
+		 * Populate the whole run of missing pages at once: a single
+		 * kernel mapping and one cache flush at the end instead of
+		 * one of each per page.
+		 */
+		run_start = page_addr;
+		nr = 0;
+		i = 0;
+		while (page_addr < end && nr < BINDER_ALLOC_MAP_BATCH &&
+		       !alloc->pages[index + nr].page_ptr) {
+			trace_binder_alloc_page_start(alloc, index + nr);
+			pages[nr] = binder_alloc_get_page(alloc);
+			if (!pages[nr]) {
+				pr_err("%d: binder_alloc_buf failed for page at %pK\n",
+					alloc->pid, page_addr);
+				goto err_alloc_page_failed;
+			}
+			nr++;
+			page_addr += PAGE_SIZE;
 		}
-		page->alloc = alloc;
-		INIT_LIST_HEAD(&page->lru);
-
-		ret = map_kernel_range_noflush((unsigned long)page_addr,
-					       PAGE_SIZE, PAGE_KERNEL,
-					       &page->page_ptr);
-		flush_cache_vmap((unsigned long)page_addr,
-				(unsigned long)page_addr + PAGE_SIZE);
-		if (ret != 1) {
-			pr_err("%d: binder_alloc_buf failed to map page at %pK in kernel\n",
-			       alloc->pid, page_addr);
+
+		ret = map_kernel_range_noflush((unsigned long)run_start,
+					       nr * PAGE_SIZE, PAGE_KERNEL,
+					       pages);
+		if (ret != nr) {
+			pr_err("%d: binder_alloc_buf failed to map pages at %pK in kernel\n",
+			       alloc->pid, run_start);
 			goto err_map_kernel_failed;
 		}
-		user_page_addr =
-			(uintptr_t)page_addr + alloc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0].page_ptr);
-		if (ret) {
-			pr_err("%d: binder_alloc_buf failed to map page at %lx in userspace\n",
-			       alloc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
-		}
 
-		if (index + 1 > alloc->pages_high)
-			alloc->pages_high = index + 1;
+		for (i = 0; i < nr; i++) {
+			user_page_addr = (uintptr_t)run_start + i * PAGE_SIZE +
+					 alloc->user_buffer_offset;
+			ret = vm_insert_page(vma, user_page_addr, pages[i]);
+			if (ret) {
+				pr_err("%d: binder_alloc_buf failed to map page at %lx in userspace\n",
+				       alloc->pid, user_page_addr);
+				goto err_vm_insert_page_failed;
+			}
+			page = &alloc->pages[index + i];
+			page->page_ptr = pages[i];
+			page->alloc = alloc;
+			INIT_LIST_HEAD(&page->lru);
+
+			trace_binder_alloc_page_end(alloc, index + i);
+			/* vm_insert_page does not seem to increment the refcount */
+		}
 
-		trace_binder_alloc_page_end(alloc, index);
-		/* vm_insert_page does not seem to increment the refcount */
+		if (index + nr > alloc->pages_high)
+			alloc->pages_high = index + nr;
 	}
+	flush_cache_vmap((unsigned long)start, (unsigned long)end);
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		bool ret;
-		size_t index;
-
-		index = (page_addr - alloc->buffer) / PAGE_SIZE;
-		page = &alloc->pages[index];
-
-		trace_binder_free_lru_start(alloc, index);
-
-		ret = list_lru_add(&binder_alloc_lru, &page->lru);
-		WARN_ON(!ret);
-
-		trace_binder_free_lru_end(alloc, index);
-		continue;
-
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(page->page_ptr);
-		page->page_ptr = NULL;
+	/* pages[0..i) were committed and are rolled back below */
+	unmap_kernel_range((unsigned long)run_start + i * PAGE_SIZE,
+			   (nr - i) * PAGE_SIZE);
 err_alloc_page_failed:
+	while (nr > i)
+		__free_page(pages[--nr]);
+	page_addr = run_start + i * PAGE_SIZE;
 err_page_ptr_cleared:
-		;
-	}
+	flush_cache_vmap((unsigned long)start, (unsigned long)page_addr);
+	binder_free_page_range(alloc, start, page_addr);
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -638,6 +735,7 @@ void binder_alloc_free_buf(struct binder_alloc *alloc,
 {
 	mutex_lock(&alloc->mutex);
 	binder_free_buf_locked(alloc, buffer);
+	binder_alloc_reserve_fill(alloc);
 	mutex_unlock(&alloc->mutex);
 }
 
@@ -792,6 +890,14 @@ void binder_alloc_deferred_release(struct binder_alloc *alloc)
 		kfree(alloc->pages);
 		vfree(alloc->buffer);
 	}
+	while (!list_empty(&alloc->reserve)) {
+		struct page *page = list_first_entry(&alloc->reserve,
+						     struct page, lru);
+
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	alloc->reserve_count = 0;
 	mutex_unlock(&alloc->mutex);
 	if (alloc->vma_vm_mm)
 		mmdrop(alloc->vma_vm_mm);
@@ -858,6 +964,9 @@ void binder_alloc_print_pages(struct seq_file *m,
 	mutex_unlock(&alloc->mutex);
 	seq_printf(m, "  pages: %d:%d:%d\n", active, lru, free);
 	seq_printf(m, "  pages high watermark: %zu\n", alloc->pages_high);
+	seq_printf(m, "  page reserve: %zu hits %lu misses %lu\n",
+		   alloc->reserve_count, alloc->reserve_hits,
+		   alloc->reserve_misses);
 }
 
 /**
@@ -1004,6 +1113,7 @@ void binder_alloc_init(struct binder_alloc *alloc)
 	alloc->pid = current->group_leader->pid;
 	mutex_init(&alloc->mutex);
 	INIT_LIST_HEAD(&alloc->buffers);
+	INIT_LIST_HEAD(&alloc->reserve);
 }
 
 void binder_alloc_shrinker_init(void)
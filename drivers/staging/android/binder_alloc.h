@@ -24,6 +24,7 @@
 #include <linux/list_lru.h>
 
 extern struct list_lru binder_alloc_lru;
+extern unsigned int binder_alloc_reserve_pages;
 struct binder_transaction;
 
 /**
@@ -92,6 +93,12 @@ struct binder_lru_page {
  * @buffer_size:        size of address space specified via mmap
  * @pid:                pid for associated binder_proc (invariant after init)
  * @pages_high:         high watermark of offset in @pages
+ * @reserve:            zeroed pages ready to populate @pages with
+ * @reserve_count:      number of pages on @reserve
+ * @reserve_cold:       pages allocated on the transaction path since
+ *                      @reserve was last refilled
+ * @reserve_hits:       pages populated from @reserve
+ * @reserve_misses:     pages populated from the page allocator
  *
  * Bookkeeping structure for per-proc address space management for binder
  * buffers. It is normally initialized during binder_init() and binder_mmap()
@@ -113,6 +120,11 @@ struct binder_alloc {
 	uint32_t buffer_free;
 	int pid;
 	size_t pages_high;
+	struct list_head reserve;
+	size_t reserve_count;
+	size_t reserve_cold;
+	unsigned long reserve_hits;
+	unsigned long reserve_misses;
 };
 
 #ifdef CONFIG_ANDROID_BINDER_IPC_SELFTEST
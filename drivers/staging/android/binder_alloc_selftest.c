@@ -279,6 +279,73 @@ static void binder_selftest_alloc_offset(struct binder_alloc *alloc,
 	}
 }
 
+/**
+ * binder_selftest_reserve() - Test population from the warm page reserve.
+ * @alloc: Pointer to alloc struct.
+ *
+ * Populate a cold buffer of a reserve's worth of pages from the page
+ * allocator, which arms the reserve refill on free. After the shrinker
+ * has released the buffer pages again, the same buffer should be
+ * populated entirely from the reserve.
+ */
+static void binder_selftest_reserve(struct binder_alloc *alloc)
+{
+	struct binder_buffer *buffer;
+	unsigned long hits, misses;
+	size_t size, nr_pages = binder_alloc_reserve_pages;
+
+	if (!nr_pages || nr_pages * PAGE_SIZE > alloc->buffer_size / 2)
+		return;
+	size = nr_pages * PAGE_SIZE;
+
+	/* Start from an empty reserve with no cold pages accounted. */
+	mutex_lock(&alloc->mutex);
+	while (!list_empty(&alloc->reserve)) {
+		struct page *page = list_first_entry(&alloc->reserve,
+						     struct page, lru);
+
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	alloc->reserve_count = 0;
+	alloc->reserve_cold = 0;
+	mutex_unlock(&alloc->mutex);
+
+	misses = alloc->reserve_misses;
+	buffer = binder_alloc_new_buf(alloc, size, 0, 0, 0);
+	if (IS_ERR(buffer) ||
+	    !check_buffer_pages_allocated(alloc, buffer, size)) {
+		pr_err("reserve: cold alloc failed\n");
+		binder_selftest_failures++;
+		return;
+	}
+	binder_alloc_free_buf(alloc, buffer);
+	binder_selftest_free_page(alloc);
+	if (alloc->reserve_count != nr_pages) {
+		pr_err("reserve: expect %zu pages but has %zu (%lu misses)\n",
+		       nr_pages, alloc->reserve_count,
+		       alloc->reserve_misses - misses);
+		binder_selftest_failures++;
+		return;
+	}
+
+	hits = alloc->reserve_hits;
+	buffer = binder_alloc_new_buf(alloc, size, 0, 0, 0);
+	if (IS_ERR(buffer) ||
+	    !check_buffer_pages_allocated(alloc, buffer, size)) {
+		pr_err("reserve: warm alloc failed\n");
+		binder_selftest_failures++;
+		return;
+	}
+	if (alloc->reserve_hits - hits != nr_pages) {
+		pr_err("reserve: expect %zu hits but got %lu\n",
+		       nr_pages, alloc->reserve_hits - hits);
+		binder_selftest_failures++;
+	}
+	binder_alloc_free_buf(alloc, buffer);
+	binder_selftest_free_page(alloc);
+}
+
 /**
  * binder_selftest_alloc() - Test alloc and free of buffer pages.
  * @alloc: Pointer to alloc struct.
@@ -286,7 +353,8 @@ static void binder_selftest_alloc_offset(struct binder_alloc *alloc,
  * Allocate BUFFER_NUM buffers to cover all page alignment cases,
  * then free them in all orders possible. Check that pages are
  * correctly allocated, put onto lru when buffers are freed, and
- * are freed when binder_alloc_free_page is called.
+ * are freed when binder_alloc_free_page is called. Then check that
+ * cold pages are populated from the warm page reserve.
  */
 void binder_selftest_alloc(struct binder_alloc *alloc)
 {
@@ -299,6 +367,7 @@ void binder_selftest_alloc(struct binder_alloc *alloc)
 		goto done;
 	pr_info("STARTED\n");
 	binder_selftest_alloc_offset(alloc, end_offset, 0);
+	binder_selftest_reserve(alloc);
 	binder_selftest_run = false;
 	if (binder_selftest_failures > 0)
 		pr_info("%d tests FAILED\n", binder_selftest_failures);
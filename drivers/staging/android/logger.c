@@ -23,6 +23,7 @@
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/time.h>
 #include "logger.h"
@@ -34,16 +35,24 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers never sleep on the log: they reserve space under 'lock', copy
+ * their entry in without it, and then publish it by moving 'w_off' up to
+ * the end of their reservation, in reservation order.  Readers only look
+ * at entries before 'w_off'.  The offsets and the reader list are
+ * protected by 'lock', the mutex only serializes readers and ioctls.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* serializes readers */
+	spinlock_t		lock;	/* protects offsets and readers */
+	size_t			w_off;	/* end of the published entries */
+	size_t			reserve; /* next free offset for writers */
+	__u32			seq;	/* bytes reserved so far, wraps */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -52,7 +61,8 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off is protected by log->lock, the rest by
+ * log->mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
@@ -60,8 +70,13 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	bool			r_batch; /* read() returns many entries */
+	struct logger_entry	*scratch; /* entry being copied to user */
 };
 
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -113,7 +128,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * get_entry_msg_len - Grabs the length of the message of the entry
  * starting from from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -157,54 +172,60 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * get_w_off - returns the end of the entries that are safe to read
  *
- * Caller must hold log->mutex.
+ * Writers publish w_off after copying their entry in, so order the read
+ * of the offset before any read of the buffer.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static inline size_t get_w_off(struct logger_log *log)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
-	size_t len;
-	size_t msg_start;
+	size_t w_off = ACCESS_ONCE(log->w_off);
 
-	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
-	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
-	if (copy_header_to_user(reader->r_ver, entry, buf))
-		return -EFAULT;
+	smp_rmb();
+	return w_off;
+}
 
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
+/*
+ * do_read_log - copies the next entry, 'count' bytes including its header,
+ * into the reader's scratch buffer and moves the reader past it.
+ *
+ * Caller must hold log->lock.
+ */
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
+{
+	size_t len;
 
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
-		return -EFAULT;
+	len = min(count, log->size - reader->r_off);
+	memcpy(reader->scratch, log->buffer + reader->r_off, len);
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy((void *) reader->scratch + len, log->buffer,
+		       count - len);
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+	reader->r_off = logger_offset(reader->r_off + count);
+}
 
-	return count + get_user_hdr_len(reader->r_ver);
+/*
+ * copy_entry_to_user - copies the entry in the reader's scratch buffer to
+ * the user-space buffer 'buf', using the header version the reader asked
+ * for.  Returns the number of bytes copied.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t copy_entry_to_user(struct logger_reader *reader,
+				  char __user *buf)
+{
+	struct logger_entry *entry = reader->scratch;
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
+		return -EFAULT;
+
+	return hdr_len + entry->len;
 }
 
 /*
@@ -214,7 +235,7 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 static size_t get_next_entry_by_uid(struct logger_log *log,
 		size_t off, uid_t euid)
 {
-	while (off != log->w_off) {
+	while (off != get_w_off(log)) {
 		struct logger_entry *entry;
 		struct logger_entry scratch;
 		size_t next_len;
@@ -231,6 +252,49 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+/*
+ * logger_read_entry - copies the reader's next entry to 'buf' if it fits in
+ * 'count' bytes.
+ *
+ * Returns the number of bytes copied, 0 if there is nothing to read, or
+ * -EINVAL if the entry does not fit.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t logger_read_entry(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf, size_t count)
+{
+	size_t len;
+
+	spin_lock(&log->lock);
+
+	if (!reader->r_all)
+		reader->r_off = get_next_entry_by_uid(log,
+			reader->r_off, current_euid());
+
+	if (get_w_off(log) == reader->r_off) {
+		spin_unlock(&log->lock);
+		return 0;
+	}
+
+	/* get the size of the next entry */
+	len = get_entry_msg_len(log, reader->r_off);
+	if (count < get_user_hdr_len(reader->r_ver) + len) {
+		spin_unlock(&log->lock);
+		return -EINVAL;
+	}
+
+	/*
+	 * get exactly one entry from the log; it goes through the scratch
+	 * buffer so that writers never wait on a faulting copy_to_user
+	 */
+	do_read_log(log, reader, sizeof(struct logger_entry) + len);
+	spin_unlock(&log->lock);
+
+	return copy_entry_to_user(reader, buf);
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -238,7 +302,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode as many
+ * 	  whole entries as are available and fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -248,16 +313,16 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	ssize_t ret, copied = 0;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = (get_w_off(log) == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -279,30 +344,21 @@ start:
 		return ret;
 
 	mutex_lock(&log->mutex);
+	do {
+		ret = logger_read_entry(log, reader, buf + copied,
+					count - copied);
+		if (ret <= 0)
+			break;
+		copied += ret;
+	} while (reader->r_batch);
+	mutex_unlock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+	if (copied)
+		return copied;
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	if (unlikely(!ret))
 		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
-
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -311,7 +367,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -350,16 +406,21 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * Every reader sits between the head and the write offset, so a write that
+ * does not reach the head cannot lap anyone and the walk is skipped.
+ *
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
+	size_t old = log->reserve;
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (!clock_interval(old, new, log->head))
+		return;
+
+	log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -367,128 +428,143 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at offset 'off',
+ * which the caller has reserved.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * publish_log - makes the entry reserved at [start, end) visible to readers
+ *
+ * Entries are published in the order their space was reserved, so wait for
+ * the writers that reserved before us.  Writers run with preemption disabled
+ * from reservation to publication and only have a memcpy to do in between,
+ * so the wait is short.
+ */
+static void publish_log(struct logger_log *log, size_t start, size_t end)
+{
+	while (ACCESS_ONCE(log->w_off) != start)
+		cpu_relax();
 
+	/* the entry must be in place before readers can see it */
+	smp_wmb();
+	ACCESS_ONCE(log->w_off) = end;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * copy_entry_from_user - copies up to 'entry->len' bytes of payload from the
+ * user-space vectors 'iov' into 'entry'.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns 0 on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_entry_from_user(struct logger_entry *entry,
+				const struct iovec *iov, unsigned long nr_segs)
 {
-	size_t len;
+	size_t count = 0;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && count < entry->len) {
+		/* figure out how much of this vector we can keep */
+		size_t len = min_t(size_t, iov->iov_len, entry->len - count);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		if (copy_from_user(entry->msg + count, iov->iov_base, len))
 			return -EFAULT;
 
-	/* print as kernel log if the log string starts with "!@" */
-	if (count >= 2) {
-		if (log->buffer[log->w_off] == '!'
-		    && log->buffer[logger_offset(log->w_off + 1)] == '@') {
-			char tmp[256];
-			int i;
-			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
-				tmp[i] =
-				    log->buffer[logger_offset(log->w_off + i)];
-			tmp[i] = '\0';
-			printk("%s\n", tmp);
-		}
+		iov++;
+		count += len;
 	}
 
-	log->w_off = logger_offset(log->w_off + count);
-
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled outside the log first, so that nothing that can
+ * fault or sleep happens while other writers may be waiting on us.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *entry;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	size_t len, start;
+	ssize_t ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.euid = current_euid();
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
-	header.hdr_size = sizeof(struct logger_entry);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	entry = kmalloc(sizeof(struct logger_entry) + len, GFP_KERNEL);
+	if (unlikely(!entry))
+		return -ENOMEM;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	now = current_kernel_time();
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
+	entry->euid = current_euid();
+	entry->len = len;
+	entry->hdr_size = sizeof(struct logger_entry);
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	ret = copy_entry_from_user(entry, iov, nr_segs);
+	if (unlikely(ret))
+		goto out;
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	/* print as kernel log if the log string starts with "!@" */
+	if (len >= 2 && entry->msg[0] == '!' && entry->msg[1] == '@') {
+		char tmp[256];
+		size_t n = min(len, sizeof(tmp) - 1);
 
-		iov++;
-		ret += nr;
+		memcpy(tmp, entry->msg, n);
+		tmp[n] = '\0';
+		printk("%s\n", tmp);
 	}
 
-	mutex_unlock(&log->mutex);
+	len += sizeof(struct logger_entry);
+
+	preempt_disable();
+
+	spin_lock(&log->lock);
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after the space we are about to fill.
+	 */
+	fix_up_readers(log, len);
+	start = log->reserve;
+	log->reserve = logger_offset(start + len);
+	log->seq += len;
+	spin_unlock(&log->lock);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	do_write_log(log, start, entry, len);
+	publish_log(log, start, logger_offset(start + len));
 
+	preempt_enable();
+
+	/* wake up any blocked readers; pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+
+	ret = entry->len;
+out:
+	kfree(entry);
 	return ret;
 }
 
@@ -519,17 +595,24 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->scratch = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->scratch) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_batch = false;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -550,9 +633,10 @@ static int logger_release(struct inode *inode, struct file *file)
 		struct logger_log *log;
 		unsigned long start = jiffies;
 		log = get_log_from_minor(MINOR(inode->i_rdev));
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		kfree(reader->scratch);
 		kfree(reader);
 		pr_info("%s: took %d msec\n", __func__,
 			jiffies_to_msecs(jiffies - start));
@@ -584,18 +668,79 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (get_w_off(log) != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the ring itself, read-only, for collectors that want to parse the
+ * entries in place; LOGGER_GET_OFFSETS tells them where the entries are.
+ * Since that bypasses the per-uid filtering, only readers allowed to read
+ * every entry may map the log.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (vma->vm_pgoff || size > log->size)
+		return -EINVAL;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(log->buffer) >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
+
+static long logger_get_offsets(struct logger_log *log, void __user *arg)
+{
+	struct logger_offsets offsets;
+
+	spin_lock(&log->lock);
+	offsets.head = log->head;
+	offsets.w_off = get_w_off(log);
+	offsets.seq = log->seq;
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(arg, &offsets, sizeof(offsets)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long logger_set_batch(struct logger_reader *reader, void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	reader->r_batch = !!batch;
+	return 0;
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -613,6 +758,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	size_t w_off;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
@@ -628,10 +774,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		spin_lock(&log->lock);
+		w_off = get_w_off(log);
+		if (w_off >= reader->r_off)
+			ret = w_off - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = (log->size - reader->r_off) + w_off;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -639,25 +788,30 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		spin_lock(&log->lock);
 
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
 
-		if (log->w_off != reader->r_off)
+		if (get_w_off(log) != reader->r_off)
 			ret = get_user_hdr_len(reader->r_ver) +
 				get_entry_msg_len(log, reader->r_off);
 		else
 			ret = 0;
+		spin_unlock(&log->lock);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
+		spin_lock(&log->lock);
+		w_off = get_w_off(log);
 		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+			reader->r_off = w_off;
+		log->head = w_off;
+		spin_unlock(&log->lock);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -676,6 +830,21 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = logger_set_version(reader, argp);
 		break;
+	case LOGGER_SET_BATCH:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_set_batch(reader, argp);
+		break;
+	case LOGGER_GET_OFFSETS:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		ret = logger_get_offsets(log, argp);
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
@@ -688,6 +857,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -697,10 +867,11 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).  The buffer is
+ * page aligned so that it can be mapped to userspace.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -712,7 +883,10 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.reserve = 0, \
+	.seq = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -51,6 +51,19 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Returned by LOGGER_GET_OFFSETS, for readers that mmap the log.  Entries
+ * start at 'head' and end at 'w_off', both offsets into the mapping.  Writers
+ * may overwrite anything from 'w_off' on, so data read from the mapping is
+ * intact if 'seq' has advanced by less than its distance ahead of 'w_off'
+ * when checked again after the read.
+ */
+struct logger_offsets {
+	__u32		head;	/* offset of the oldest entry */
+	__u32		w_off;	/* end of the newest complete entry */
+	__u32		seq;	/* bytes handed to writers so far, wraps */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -67,5 +80,8 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH		_IO(__LOGGERIO, 7) /* multi-entry read */
+#define LOGGER_GET_OFFSETS		_IOR(__LOGGERIO, 8, \
+					     struct logger_offsets)
 
 #endif /* _LINUX_LOGGER_H */
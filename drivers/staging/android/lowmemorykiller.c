@@ -17,6 +17,12 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * The thresholds are only evaluated when reclaim reports memory pressure
+ * (see mm/vmpressure.c), and /sys/module/lowmemorykiller/parameters/
+ * level_policy selects, for the low, medium and critical levels, whether
+ * to do nothing (0), apply the tables (1) or apply them to free memory
+ * alone (2).  At most one process is killed per kill_interval_ms.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -34,7 +40,6 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
-#include <linux/delay.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
@@ -42,6 +47,10 @@
 #include <linux/ratelimit.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
+#include <linux/err.h>
+#include <linux/vmpressure.h>
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 #include <linux/string.h>
 #endif
@@ -106,6 +115,53 @@ static bool is_in_donotkill_proc_list(char *proc_name)
 
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * What to do at each vmpressure level: nothing, apply the minfree table,
+ * or apply it counting free pages only.  At critical pressure reclaim
+ * has just shown that it cannot turn the file cache into free memory
+ * fast enough, so the cache should not keep us from killing.
+ */
+enum {
+	LOWMEM_POLICY_NONE,
+	LOWMEM_POLICY_MINFREE,
+	LOWMEM_POLICY_FREE_ONLY,
+};
+
+#define LOWMEM_POLICY_MAX	LOWMEM_POLICY_FREE_ONLY
+
+static int lowmem_level_policy[VMPRESSURE_NUM_LEVELS] = {
+	[VMPRESSURE_LOW]	= LOWMEM_POLICY_NONE,
+	[VMPRESSURE_MEDIUM]	= LOWMEM_POLICY_MINFREE,
+	[VMPRESSURE_CRITICAL]	= LOWMEM_POLICY_FREE_ONLY,
+};
+
+static int lowmem_policy_set(const char *val, const struct kernel_param *kp)
+{
+	int policy, ret;
+
+	ret = kstrtoint(val, 0, &policy);
+	if (ret)
+		return ret;
+	if (policy < LOWMEM_POLICY_NONE || policy > LOWMEM_POLICY_MAX)
+		return -EINVAL;
+
+	*(int *)kp->arg = policy;
+	return 0;
+}
+
+static struct kernel_param_ops param_ops_lowmem_policy = {
+	.set = lowmem_policy_set,
+	.get = param_get_int,
+};
+#define param_check_lowmem_policy(name, p) __param_check(name, p, int)
+
+/* Minimum time between two kills, so one burst of reclaim kills once */
+static unsigned int lowmem_kill_interval_ms = 100;
+static unsigned long lowmem_next_kill;
+
+/* Serializes kill decisions; pressure work may run on several cpus */
+static DEFINE_MUTEX(lowmem_kill_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -118,20 +174,222 @@ static unsigned long lowmem_deathpending_timeout;
 			pr_err_ratelimited(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Thread groups sorted by oom_score_adj, so that a victim is found by
+ * walking down from the highest score instead of scanning every task.
+ * The tree is kept up to date on fork, exit and every oom_score_adj
+ * change (see linux/oom.h).  lowmem_adj_lock nests inside tasklist_lock
+ * and siglock, which are taken from interrupts, so it must be taken with
+ * interrupts disabled; nothing is taken while holding it.
+ */
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct rb_root lowmem_adj_tree = RB_ROOT;
+
+void lowmem_adj_tree_add(struct task_struct *task)
+{
+	struct signal_struct *sig = task->signal;
+	struct rb_node **link = &lowmem_adj_tree.rb_node;
+	struct rb_node *parent = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	/* A /proc write may beat fork to inserting a new child */
+	if (!RB_EMPTY_NODE(&sig->adj_node))
+		goto out;
+	while (*link) {
+		struct signal_struct *entry;
+
+		parent = *link;
+		entry = rb_entry(parent, struct signal_struct, adj_node);
+		if (sig->oom_score_adj < entry->oom_score_adj)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&sig->adj_node, parent, link);
+	rb_insert_color(&sig->adj_node, &lowmem_adj_tree);
+out:
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+void lowmem_adj_tree_del(struct task_struct *task)
 {
-	struct task_struct *tsk;
+	struct signal_struct *sig = task->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!RB_EMPTY_NODE(&sig->adj_node)) {
+		rb_erase(&sig->adj_node, &lowmem_adj_tree);
+		RB_CLEAR_NODE(&sig->adj_node);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Highest-scored group whose oom_score_adj is at most @limit */
+static struct rb_node *lowmem_adj_tree_last(int limit)
+{
+	struct rb_node *node = lowmem_adj_tree.rb_node;
+	struct rb_node *last = NULL;
+
+	while (node) {
+		struct signal_struct *sig;
+
+		sig = rb_entry(node, struct signal_struct, adj_node);
+		if (sig->oom_score_adj <= limit) {
+			last = node;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return last;
+}
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
+/* Protect a white-listed process from further kills by demoting it */
+static void lowmem_protect(struct task_struct *p)
+{
+	unsigned long flags;
+
+	if (!lock_task_sighand(p, &flags))
+		return;
+	lowmem_print(2, "[lmk] set oom_score_adj from %d to %d for (%s)\n",
+		     p->signal->oom_score_adj, 0, p->comm);
+	lowmem_adj_tree_del(p);
+	p->signal->oom_score_adj = 0;
+	lowmem_adj_tree_add(p);
+	unlock_task_sighand(p, &flags);
+}
+#endif
+
+#define LOWMEM_BATCH	32
+
+/*
+ * Pick the victim: the highest oom_score_adj at or above @min_score_adj,
+ * and the largest rss among groups sharing that score.  Candidates are
+ * collected from the top of the tree in batches, so the cost depends on
+ * the number of killable groups, not on the number of tasks.  Groups
+ * past a full batch that share its lowest score are not looked at.
+ *
+ * Must be called under rcu_read_lock(), which keeps the collected
+ * task_structs alive after lowmem_adj_lock has been dropped.  Returns
+ * NULL if there is nothing to kill, or ERR_PTR(-EBUSY) if an earlier
+ * victim is still dying.
+ */
+static struct task_struct *lowmem_select(int min_score_adj, int *sizep,
+					 int *adjp)
+{
+	struct task_struct *batch[LOWMEM_BATCH];
 	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj = min_score_adj;
+	int limit = OOM_SCORE_ADJ_MAX;
+	int n, i;
+
+	while (!selected && limit >= min_score_adj) {
+		struct rb_node *node;
+
+		n = 0;
+		spin_lock_irq(&lowmem_adj_lock);
+		for (node = lowmem_adj_tree_last(limit); node;
+		     node = rb_prev(node)) {
+			struct signal_struct *sig;
+
+			sig = rb_entry(node, struct signal_struct, adj_node);
+			if (sig->oom_score_adj < min_score_adj) {
+				node = NULL;
+				break;
+			}
+			limit = sig->oom_score_adj - 1;
+			if (sig->curr_target->flags & PF_KTHREAD)
+				continue;
+			batch[n++] = sig->curr_target;
+			if (n == LOWMEM_BATCH)
+				break;
+		}
+		spin_unlock_irq(&lowmem_adj_lock);
+		if (!node)
+			limit = min_score_adj - 1;
+
+		for (i = 0; i < n; i++) {
+			struct task_struct *p;
+			int oom_score_adj;
+			int tasksize;
+
+			p = find_lock_task_mm(batch[i]);
+			if (!p)
+				continue;
+
+			if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+			    time_before_eq(jiffies,
+					   lowmem_deathpending_timeout)) {
+				task_unlock(p);
+				return ERR_PTR(-EBUSY);
+			}
+			oom_score_adj = p->signal->oom_score_adj;
+			if (oom_score_adj < min_score_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected) {
+				if (oom_score_adj < selected_oom_score_adj)
+					continue;
+				if (oom_score_adj == selected_oom_score_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
+			if (is_in_donotkill_proc_list(p->comm)) {
+				lowmem_print_ratelimited(2, "[lmk] the process '%s' is inside the donotkill_proc_names\n", p->comm);
+				lowmem_protect(p);
+				continue;
+			}
+#endif
+
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
+				     p->comm, p->pid, oom_score_adj, tasksize);
+		}
+	}
+
+	*sizep = selected_tasksize;
+	*adjp = selected_oom_score_adj;
+	return selected;
+}
+
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long level, void *data)
+{
+	unsigned long pressure = *(unsigned long *)data;
+	struct task_struct *selected;
 	int i;
 	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int minfree = 0;
-	int selected_tasksize = 0;
+	int selected_tasksize;
 	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-	int other_file = global_page_state(NR_FILE_PAGES) -
+	int other_free;
+	int other_file;
+
+	if (lowmem_level_policy[level] == LOWMEM_POLICY_NONE)
+		return NOTIFY_DONE;
+	if (time_before(jiffies, lowmem_next_kill))
+		return NOTIFY_DONE;
+	if (!mutex_trylock(&lowmem_kill_lock))
+		return NOTIFY_DONE;
+
+	other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+	if (lowmem_level_policy[level] == LOWMEM_POLICY_FREE_ONLY)
+		other_file = 0;
+	else
+		other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
 	if (lowmem_adj_size < array_size)
@@ -145,79 +403,19 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			break;
 		}
 	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
-	}
-	selected_oom_score_adj = min_score_adj;
+	lowmem_print(3, "lowmem_vmpressure level %lu, pressure %lu, ofree %d %d, ma %d\n",
+		     level, pressure, other_free, other_file, min_score_adj);
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1)
+		goto out;
 
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-
-#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
-		if (is_in_donotkill_proc_list(p->comm)) {
-			lowmem_print_ratelimited(2, "[lmk] the process '%s' is inside the donotkill_proc_names\n", p->comm);
-			lowmem_print_ratelimited(2, "[lmk] set oom_score_adj from %d to %d for (%s)\n", p->signal->oom_score_adj, 0, p->comm);
-			p->signal->oom_score_adj = 0;
-			continue;
-		}
-#endif
-
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
-	}
-	if (selected) {
-#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
-		if (!is_in_donotkill_proc_list(selected->comm)) {
-#endif
-			lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
+	selected = lowmem_select(min_score_adj, &selected_tasksize,
+				 &selected_oom_score_adj);
+	if (!IS_ERR_OR_NULL(selected)) {
+		lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
 				"   to free %ldkB on behalf of '%s' (%d) because\n" \
 				"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
-				"   Free memory is %ldkB above reserved\n",
+				"   Free memory is %ldkB above reserved, pressure %lu\n",
 			     selected->comm, selected->pid,
 			     selected_oom_score_adj,
 			     selected_tasksize * (long)(PAGE_SIZE / 1024),
@@ -225,45 +423,33 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     other_file * (long)(PAGE_SIZE / 1024),
 			     minfree * (long)(PAGE_SIZE / 1024),
 			     min_score_adj,
-			     other_free * (long)(PAGE_SIZE / 1024));
-			lowmem_deathpending_timeout = jiffies + HZ;
-			send_sig(SIGKILL, selected, 0);
-			set_tsk_thread_flag(selected, TIF_MEMDIE);
-			rem -= selected_tasksize;
-#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
-		} else {
-			lowmem_print(1, "[lmk] the process '%s' is inside the donotkill_proc_names\n", selected->comm);
-			lowmem_print(2, "[lmk] set oom_score_adj from %d to %d for (%s)\n", selected->signal->oom_score_adj, 0, selected->comm);
-			selected->signal->oom_score_adj = 0;
-			rcu_read_unlock();
-			/* give the system time to free up the memory */
-			msleep_interruptible(20);
-
-		}
-
-#endif
+			     other_free * (long)(PAGE_SIZE / 1024),
+			     pressure);
+		lowmem_deathpending_timeout = jiffies + HZ;
+		lowmem_next_kill = jiffies +
+			msecs_to_jiffies(lowmem_kill_interval_ms);
+		send_sig(SIGKILL, selected, 0);
+		set_tsk_thread_flag(selected, TIF_MEMDIE);
 	}
-
-	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
-		     sc->nr_to_scan, sc->gfp_mask, rem);
 	rcu_read_unlock();
-	return rem;
+out:
+	mutex_unlock(&lowmem_kill_lock);
+	return NOTIFY_OK;
 }
 
-static struct shrinker lowmem_shrinker = {
-	.shrink = lowmem_shrink,
-	.seeks = DEFAULT_SEEKS * 16
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notify,
 };
 
 static int __init lowmem_init(void)
 {
-	register_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
-	unregister_shrinker(&lowmem_shrinker);
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -343,7 +529,6 @@ static const struct kparam_array __param_arr_adj = {
 };
 #endif
 
-module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
 __module_param_call(MODULE_PARAM_PREFIX, adj,
 		    &lowmem_adj_array_ops,
@@ -357,6 +542,10 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_array_named(level_policy, lowmem_level_policy, lowmem_policy, NULL,
+			 S_IRUGO | S_IWUSR);
+module_param_named(kill_interval_ms, lowmem_kill_interval_ms, uint,
+		   S_IRUGO | S_IWUSR);
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_DO_NOT_KILL_PROCESS
 module_param_named(donotkill_proc, donotkill_proc.enabled, uint, S_IRUGO | S_IWUSR);
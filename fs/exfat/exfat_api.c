@@ -54,7 +54,6 @@
 /*  Global Variable Definitions                                         */
 /*----------------------------------------------------------------------*/
 
-extern struct semaphore z_sem;
 
 /*----------------------------------------------------------------------*/
 /*  Local Variable Definitions                                          */
@@ -94,16 +93,13 @@ int FsMountVol(struct super_block *sb)
 {
 	int err;
 
-	sm_P(&z_sem);
-
+	/* everything set up here is per volume, no global lock is needed */
 	err = buf_init(sb);
 	if (!err)
 		err = ffsMountVol(sb);
 	else
 		buf_shutdown(sb);
 
-	sm_V(&z_sem);
-
 	return err;
 } /* end of FsMountVol */
 
@@ -113,8 +109,6 @@ int FsUmountVol(struct super_block *sb)
 	int err;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&z_sem);
-
 	/* acquire the lock for file system critical section */
 	sm_P(&p_fs->v_sem);
 
@@ -124,8 +118,6 @@ int FsUmountVol(struct super_block *sb)
 	/* release the lock for file system critical section */
 	sm_V(&p_fs->v_sem);
 
-	sm_V(&z_sem);
-
 	return err;
 } /* end of FsUmountVol */
 
@@ -273,6 +265,9 @@ int FsTruncateFile(struct inode *inode, u64 old_size, u64 new_size)
 	struct super_block *sb = inode->i_sb;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
+	/* keep lookups in FsMapCluster off the chain being freed */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
+
 	/* acquire the lock for file system critical section */
 	sm_P(&p_fs->v_sem);
 
@@ -285,6 +280,8 @@ int FsTruncateFile(struct inode *inode, u64 old_size, u64 new_size)
 	/* release the lock for file system critical section */
 	sm_V(&p_fs->v_sem);
 
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
+
 	return err;
 } /* end of FsTruncateFile */
 
@@ -391,7 +388,7 @@ int FsWriteStat(struct inode *inode, DIR_ENTRY_T *info)
 } /* end of FsWriteStat */
 
 /* FsMapCluster : return the cluster number in the given cluster offset */
-int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
+int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, int create)
 {
 	int err;
 	struct super_block *sb = inode->i_sb;
@@ -401,13 +398,22 @@ int FsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 	if (clu == NULL)
 		return FFS_ERROR;
 
-	/* acquire the lock for file system critical section */
-	sm_P(&p_fs->v_sem);
+	/*
+	 * A lookup only walks this inode's cluster chain, so it needs the
+	 * per-inode map lock and not the volume lock.  Allocating a new
+	 * cluster takes both, in that order.
+	 */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 
-	err = ffsMapCluster(inode, clu_offset, clu);
+	if (create)
+		sm_P(&p_fs->v_sem);
 
-	/* release the lock for file system critical section */
-	sm_V(&p_fs->v_sem);
+	err = ffsMapCluster(inode, clu_offset, clu, create);
+
+	if (create)
+		sm_V(&p_fs->v_sem);
+
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 
 	return err;
 } /* end of FsMapCluster */
@@ -32,6 +32,8 @@
 /*                                                                      */
 /************************************************************************/
 
+#include <linux/string.h>
+
 #include "exfat_config.h"
 #include "exfat_bitmap.h"
 
@@ -61,3 +63,20 @@ void exfat_bitmap_clear(u8 *bitmap, int i)
 {
 	bitmap[BITMAP_LOC(i)] &= ~(0x01 << BITMAP_SHIFT(i));
 } /* end of Bitmap_clear */
+
+void exfat_bitmap_set_range(u8 *bitmap, int i, int n)
+{
+	while ((n > 0) && BITMAP_SHIFT(i)) {
+		exfat_bitmap_set(bitmap, i++);
+		n--;
+	}
+
+	if (n >= 8) {
+		memset(bitmap + BITMAP_LOC(i), 0xFF, n >> 3);
+		i += n & ~0x07;
+		n &= 0x07;
+	}
+
+	while (n-- > 0)
+		exfat_bitmap_set(bitmap, i++);
+} /* end of Bitmap_set_range */
@@ -51,5 +51,6 @@
 s32	exfat_bitmap_test(u8 *bitmap, int i);
 void	exfat_bitmap_set(u8 *bitmap, int i);
 void	exfat_bitmap_clear(u8 *bitmpa, int i);
+void	exfat_bitmap_set_range(u8 *bitmap, int i, int n);
 
 #endif /* _EXFAT_BITMAP_H */
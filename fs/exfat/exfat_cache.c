@@ -44,8 +44,11 @@
 /*  Global Variable Definitions                                         */
 /*----------------------------------------------------------------------*/
 
-#define sm_P(s)
-#define sm_V(s)
+/*
+ * The FAT cache is shared with cluster chain lookups that run without
+ * p_fs->v_sem (see FsMapCluster), so it is guarded by the per-volume
+ * p_fs->f_sem.  The buffer cache is only used under v_sem.
+ */
 
 static s32 __FAT_read(struct super_block *sb, u32 loc, u32 *content);
 static s32 __FAT_write(struct super_block *sb, u32 loc, u32 content);
@@ -139,12 +142,13 @@ s32 buf_shutdown(struct super_block *sb)
 s32 FAT_read(struct super_block *sb, u32 loc, u32 *content)
 {
 	s32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->f_sem);
 
 	ret = __FAT_read(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->f_sem);
 
 	return ret;
 } /* end of FAT_read */
@@ -152,12 +156,13 @@ s32 FAT_read(struct super_block *sb, u32 loc, u32 *content)
 s32 FAT_write(struct super_block *sb, u32 loc, u32 content)
 {
 	s32 ret;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->f_sem);
 
 	ret = __FAT_write(sb, loc, content);
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->f_sem);
 
 	return ret;
 } /* end of FAT_write */
@@ -430,7 +435,7 @@ void FAT_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->f_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -447,7 +452,7 @@ void FAT_release_all(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->f_sem);
 } /* end of FAT_release_all */
 
 void FAT_sync(struct super_block *sb)
@@ -455,7 +460,7 @@ void FAT_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&f_sem);
+	sm_P(&p_fs->f_sem);
 
 	bp = p_fs->FAT_cache_lru_list.next;
 	while (bp != &p_fs->FAT_cache_lru_list) {
@@ -466,7 +471,7 @@ void FAT_sync(struct super_block *sb)
 		bp = bp->next;
 	}
 
-	sm_V(&f_sem);
+	sm_V(&p_fs->f_sem);
 } /* end of FAT_sync */
 
 static BUF_CACHE_T *FAT_cache_find(struct super_block *sb, u32 sec)
@@ -533,12 +538,8 @@ u8 *buf_getblk(struct super_block *sb, u32 sec)
 {
 	u8 *buf;
 
-	sm_P(&b_sem);
-
 	buf = __buf_getblk(sb, sec);
 
-	sm_V(&b_sem);
-
 	return buf;
 } /* end of buf_getblk */
 
@@ -582,45 +583,33 @@ void buf_modify(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
 		sector_write(sb, sec, bp->buf_bh, 0);
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 } /* end of buf_modify */
 
 void buf_lock(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
 		bp->flag |= LOCKBIT;
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 } /* end of buf_lock */
 
 void buf_unlock(struct super_block *sb, u32 sec)
 {
 	BUF_CACHE_T *bp;
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL))
 		bp->flag &= ~(LOCKBIT);
 
 	WARN(!bp, "[EXFAT] failed to find buffer_cache(sector:%u).\n", sec);
-
-	sm_V(&b_sem);
 } /* end of buf_unlock */
 
 void buf_release(struct super_block *sb, u32 sec)
@@ -628,8 +617,6 @@ void buf_release(struct super_block *sb, u32 sec)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = buf_cache_find(sb, sec);
 	if (likely(bp != NULL)) {
 		bp->drv = -1;
@@ -643,8 +630,6 @@ void buf_release(struct super_block *sb, u32 sec)
 
 		move_to_lru(bp, &p_fs->buf_cache_lru_list);
 	}
-
-	sm_V(&b_sem);
 } /* end of buf_release */
 
 void buf_release_all(struct super_block *sb)
@@ -652,8 +637,6 @@ void buf_release_all(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
 		if (bp->drv == p_fs->drv) {
@@ -668,8 +651,6 @@ void buf_release_all(struct super_block *sb)
 		}
 		bp = bp->next;
 	}
-
-	sm_V(&b_sem);
 } /* end of buf_release_all */
 
 void buf_sync(struct super_block *sb)
@@ -677,8 +658,6 @@ void buf_sync(struct super_block *sb)
 	BUF_CACHE_T *bp;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
-	sm_P(&b_sem);
-
 	bp = p_fs->buf_cache_lru_list.next;
 	while (bp != &p_fs->buf_cache_lru_list) {
 		if ((bp->drv == p_fs->drv) && (bp->flag & DIRTYBIT)) {
@@ -687,8 +666,6 @@ void buf_sync(struct super_block *sb)
 		}
 		bp = bp->next;
 	}
-
-	sm_V(&b_sem);
 } /* end of buf_sync */
 
 static BUF_CACHE_T *buf_cache_find(struct super_block *sb, u32 sec)
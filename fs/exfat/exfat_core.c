@@ -44,6 +44,7 @@
 #include <linux/version.h>
 #include <linux/param.h>
 #include <linux/log2.h>
+#include <linux/slab.h>
 
 #include "exfat_bitmap.h"
 #include "exfat_config.h"
@@ -78,7 +79,7 @@ extern u8 uni_upcase[];
 /*  Local Variable Definitions                                          */
 /*----------------------------------------------------------------------*/
 
-static u8 name_buf[MAX_PATH_LENGTH * MAX_CHARSET_SIZE];
+static struct kmem_cache *dentry_hash_cachep;
 
 static char *reserved_names[] = {
 	"AUX     ", "CON     ", "NUL     ", "PRN     ",
@@ -168,8 +169,19 @@ s32 ffsMountVol(struct super_block *sb)
 	printk("[EXFAT] trying to mount...\n");
 
 	sm_init(&p_fs->v_sem);
+	sm_init(&p_fs->f_sem);
 	p_fs->dev_ejected = FALSE;
 
+	for (i = 0; i < DENTRY_HASH_NUM_DIRS; i++) {
+		p_fs->dentry_hash[i].dir = CLUSTER_32(~0);
+		p_fs->dentry_hash[i].lru = 0;
+		p_fs->dentry_hash[i].head = NULL;
+	}
+	p_fs->dentry_hash_lru = 0;
+	for (i = 0; i < DENTRY_HASH_NUM_MISSES; i++)
+		p_fs->dentry_hash_miss[i] = CLUSTER_32(~0);
+	p_fs->dentry_hash_miss_idx = 0;
+
 	/* open the block device */
 	if (bdev_open(sb))
 		return FFS_MEDIAERR;
@@ -253,6 +265,8 @@ s32 ffsUmountVol(struct super_block *sb)
 	fs_sync(sb, 0);
 	fs_set_vol_flags(sb, VOL_CLEAN);
 
+	dentry_hash_release_all(sb);
+
 	if (p_fs->vol_type == EXFAT) {
 		free_upcase_table(sb);
 		free_alloc_bitmap(sb);
@@ -1282,7 +1296,7 @@ s32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info)
 	return FFS_SUCCESS;
 } /* end of ffsSetStat */
 
-s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
+s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, int create)
 {
 	s32 num_clusters, num_alloced, modified = FALSE;
 	u32 last_clu, sector = 0;
@@ -1327,14 +1341,19 @@ s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 		}
 	}
 
-	if (*clu == CLUSTER_32(~0)) {
+	if ((*clu == CLUSTER_32(~0)) && create) {
 		fs_set_vol_flags(sb, VOL_DIRTY);
 
 		new_clu.dir = (last_clu == CLUSTER_32(~0)) ? CLUSTER_32(~0) : last_clu+1;
 		new_clu.size = 0;
 		new_clu.flags = fid->flags;
 
-		/* (1) allocate a cluster */
+		/*
+		 * (1) allocate a cluster.  The length of the chain is taken
+		 *     from mmu_private above, so file data is allocated one
+		 *     cluster per call; alloc_cluster() keeps the chain
+		 *     contiguous by growing it in place, it does not batch.
+		 */
 		num_alloced = p_fs->fs_func->alloc_cluster(sb, 1, &new_clu);
 		if (num_alloced < 0)
 			return FFS_MEDIAERR;
@@ -1395,9 +1414,11 @@ s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu)
 		inode->i_blocks += num_alloced << (p_fs->cluster_size_bits - 9);
 	}
 
-	/* hint information */
-	fid->hint_last_off = (s32)(fid->rwoffset >> p_fs->cluster_size_bits);
-	fid->hint_last_clu = *clu;
+	/* hint information (a lookup past the end of chain leaves it alone) */
+	if (*clu != CLUSTER_32(~0)) {
+		fid->hint_last_off = (s32)(fid->rwoffset >> p_fs->cluster_size_bits);
+		fid->hint_last_clu = *clu;
+	}
 
 	if (p_fs->dev_ejected)
 		return FFS_MEDIAERR;
@@ -1700,11 +1721,22 @@ s32 fs_init(void)
 	if (sizeof(VOLM_DENTRY_T) != DENTRY_SIZE)
 		return FFS_ALIGNMENTERR;
 
+	dentry_hash_cachep = kmem_cache_create("exfat_dentry_hash",
+					       sizeof(DENTRY_HASH_NODE_T), 0,
+					       SLAB_RECLAIM_ACCOUNT, NULL);
+	if (dentry_hash_cachep == NULL)
+		return FFS_MEMORYERR;
+
 	return FFS_SUCCESS;
 } /* end of fs_init */
 
 s32 fs_shutdown(void)
 {
+	if (dentry_hash_cachep) {
+		kmem_cache_destroy(dentry_hash_cachep);
+		dentry_hash_cachep = NULL;
+	}
+
 	return FFS_SUCCESS;
 } /* end of fs_shutdown */
 
@@ -1846,15 +1878,24 @@ s32 fat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 
 s32 exfat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 {
-	s32 num_clusters = 0;
-	u32 hint_clu, new_clu, last_clu = CLUSTER_32(~0);
+	s32 num_clusters = 0, new_chain = FALSE;
+	u32 hint_clu, new_clu, run, window, last_clu = CLUSTER_32(~0);
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
+	/*
+	 * A chain that cannot grow in place is started (or continued) in
+	 * a nearby free run of at least 1 << ALLOC_RUN_SIZE_BITS bytes if
+	 * there is one, so that files written at the same time do not
+	 * interleave cluster by cluster (see find_free_run()).
+	 */
+	window = (p_fs->cluster_size_bits < ALLOC_RUN_SIZE_BITS) ?
+		(1 << (ALLOC_RUN_SIZE_BITS - p_fs->cluster_size_bits)) : 1;
+	window = max_t(u32, window, num_alloc);
+
 	hint_clu = p_chain->dir;
 	if (hint_clu == CLUSTER_32(~0)) {
-		hint_clu = test_alloc_bitmap(sb, p_fs->clu_srch_ptr-2);
-		if (hint_clu == CLUSTER_32(~0))
-			return 0;
+		hint_clu = p_fs->clu_srch_ptr;
+		new_chain = TRUE;
 	} else if (hint_clu >= p_fs->num_clusters) {
 		hint_clu = 2;
 		p_chain->flags = 0x01;
@@ -1864,23 +1905,41 @@ s32 exfat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 
 	p_chain->dir = CLUSTER_32(~0);
 
-	while ((new_clu = test_alloc_bitmap(sb, hint_clu-2)) != CLUSTER_32(~0)) {
-		if (new_clu != hint_clu) {
-			if (p_chain->flags == 0x03) {
+	while (num_alloc > 0) {
+		/* grow in place if the hinted cluster is free */
+		new_clu = CLUSTER_32(~0);
+		if (!new_chain && (hint_clu < p_fs->num_clusters)) {
+			run = scan_alloc_bitmap(sb, hint_clu-2,
+				min_t(u32, hint_clu-2 + num_alloc, p_fs->num_clusters-2), FALSE);
+			if (run > hint_clu-2) {
+				new_clu = hint_clu;
+				run -= hint_clu-2;
+			}
+		}
+
+		if (new_clu == CLUSTER_32(~0)) {
+			new_clu = find_free_run(sb, hint_clu-2, window, &run);
+			if (new_clu == CLUSTER_32(~0))
+				break;
+			new_clu += 2;
+			run = min_t(u32, run, num_alloc);
+
+			if (new_chain)
+				new_chain = FALSE;
+			else if (p_chain->flags == 0x03) {
 				exfat_chain_cont_cluster(sb, p_chain->dir, num_clusters);
 				p_chain->flags = 0x01;
 			}
 		}
 
-		if (set_alloc_bitmap(sb, new_clu-2) != FFS_SUCCESS)
+		if (set_alloc_bitmap_range(sb, new_clu-2, run) != FFS_SUCCESS)
 			return -1;
 
-		num_clusters++;
+		num_clusters += run;
+		num_alloc -= run;
 
-		if (p_chain->flags == 0x01) {
-			if (FAT_write(sb, new_clu, CLUSTER_32(~0)) < 0)
-				return -1;
-		}
+		if (p_chain->flags == 0x01)
+			exfat_chain_cont_cluster(sb, new_clu, run);
 
 		if (p_chain->dir == CLUSTER_32(~0)) {
 			p_chain->dir = new_clu;
@@ -1890,22 +1949,13 @@ s32 exfat_alloc_cluster(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain)
 					return -1;
 			}
 		}
-		last_clu = new_clu;
-
-		if ((--num_alloc) == 0) {
-			p_fs->clu_srch_ptr = hint_clu;
-			if (p_fs->used_clusters != (u32) ~0)
-				p_fs->used_clusters += num_clusters;
-
-			p_chain->size += num_clusters;
-			return num_clusters;
-		}
+		last_clu = new_clu + run - 1;
 
-		hint_clu = new_clu + 1;
+		hint_clu = last_clu + 1;
 		if (hint_clu >= p_fs->num_clusters) {
 			hint_clu = 2;
 
-			if (p_chain->flags == 0x03) {
+			if ((num_alloc > 0) && (p_chain->flags == 0x03)) {
 				exfat_chain_cont_cluster(sb, p_chain->dir, num_clusters);
 				p_chain->flags = 0x01;
 			}
@@ -1978,6 +2028,12 @@ void exfat_free_cluster(struct super_block *sb, CHAIN_T *p_chain, s32 do_relse)
 		return;
 	}
 
+	/* the chain may be a directory that is being removed */
+	dentry_hash_drop(sb, p_chain->dir);
+
+	/* large free runs may exist again */
+	p_fs->alloc_run_fail = 0;
+
 	__set_sb_dirty(sb);
 	clu = p_chain->dir;
 
@@ -2222,6 +2278,33 @@ s32 set_alloc_bitmap(struct super_block *sb, u32 clu)
 	return sector_write(sb, sector, p_fs->vol_amap[i], 0);
 } /* end of set_alloc_bitmap */
 
+/* set the bits of count clusters starting at clu, one write per sector */
+s32 set_alloc_bitmap_range(struct super_block *sb, u32 clu, u32 count)
+{
+	int i, b, n;
+	u32 sector;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	while (count > 0) {
+		i = clu >> (p_bd->sector_size_bits + 3);
+		b = clu & ((p_bd->sector_size << 3) - 1);
+		n = min_t(u32, count, (p_bd->sector_size << 3) - b);
+
+		sector = START_SECTOR(p_fs->map_clu) + i;
+
+		exfat_bitmap_set_range((u8 *) p_fs->vol_amap[i]->b_data, b, n);
+
+		if (sector_write(sb, sector, p_fs->vol_amap[i], 0) != FFS_SUCCESS)
+			return FFS_MEDIAERR;
+
+		clu += n;
+		count -= n;
+	}
+
+	return FFS_SUCCESS;
+} /* end of set_alloc_bitmap_range */
+
 s32 clr_alloc_bitmap(struct super_block *sb, u32 clu)
 {
 	int i, b;
@@ -2297,6 +2380,92 @@ u32 test_alloc_bitmap(struct super_block *sb, u32 clu)
 	return CLUSTER_32(~0);
 } /* end of test_alloc_bitmap */
 
+/*
+ * Return the first free (want_free) or used cluster of the bitmap at
+ * or after clu and before end, or end if there is none.  Each sector of
+ * the bitmap is searched a word at a time.
+ */
+u32 scan_alloc_bitmap(struct super_block *sb, u32 clu, u32 end, s32 want_free)
+{
+	u32 i, base, limit, b;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	while (clu < end) {
+		i = clu >> (p_bd->sector_size_bits + 3);
+		base = i << (p_bd->sector_size_bits + 3);
+		limit = min_t(u32, end - base, p_bd->sector_size << 3);
+
+		if (want_free)
+			b = find_next_zero_bit_le(p_fs->vol_amap[i]->b_data, limit, clu - base);
+		else
+			b = find_next_bit_le(p_fs->vol_amap[i]->b_data, limit, clu - base);
+
+		if (b < limit)
+			return base + b;
+		clu = base + limit;
+	}
+
+	return end;
+} /* end of scan_alloc_bitmap */
+
+/*
+ * Find a run of free clusters, searching from clu.  A run of at least
+ * want clusters is only looked for in the next ALLOC_RUN_SCAN_SECTORS
+ * sectors of the bitmap, and a run size that was not found there is not
+ * looked for again until clusters are freed.  When such a run directly
+ * follows a used cluster, that cluster is likely the tail of a chain
+ * that is still being written and will grow into the run, so the first
+ * want clusters are left to it and the returned run starts after them.
+ * Otherwise two files written at the same time would still alternate,
+ * one window at a time.  Failing that, the first free run after clu
+ * (wrapping around) is used, as test_alloc_bitmap() would.  Returns the
+ * first cluster of the run (as a bitmap index, like clu) with its
+ * length, capped at want, in *len, or CLUSTER_32(~0) if none is free.
+ */
+u32 find_free_run(struct super_block *sb, u32 clu, u32 want, u32 *len)
+{
+	u32 start, end, from, limit, total, gap;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+	BD_INFO_T *p_bd = &(EXFAT_SB(sb)->bd_info);
+
+	total = p_fs->num_clusters - 2;
+	if (clu >= total)
+		clu = 0;
+
+	if ((want > 1) && ((p_fs->alloc_run_fail == 0) || (want < p_fs->alloc_run_fail))) {
+		limit = min_t(u32, total, clu + (ALLOC_RUN_SCAN_SECTORS << (p_bd->sector_size_bits + 3)));
+
+		for (from = clu; from < limit; from = end + 1) {
+			start = scan_alloc_bitmap(sb, from, limit, TRUE);
+			if (start >= limit)
+				break;
+
+			gap = 0;
+			if ((start > 0) && (scan_alloc_bitmap(sb, start-1, start, FALSE) == start-1))
+				gap = want;
+
+			end = scan_alloc_bitmap(sb, start, min(start + gap + want, total), FALSE);
+			if ((end - start) >= (gap + want)) {
+				*len = want;
+				return start + gap;
+			}
+		}
+		p_fs->alloc_run_fail = want;
+	}
+
+	start = scan_alloc_bitmap(sb, clu, total, TRUE);
+	if (start >= total) {
+		start = scan_alloc_bitmap(sb, 0, clu, TRUE);
+		if (start >= clu)
+			return CLUSTER_32(~0);
+	}
+
+	end = scan_alloc_bitmap(sb, start, min(start + want, total), FALSE);
+	*len = end - start;
+	return start;
+} /* end of find_free_run */
+
 void sync_alloc_bitmap(struct super_block *sb)
 {
 	int i;
@@ -2915,7 +3084,7 @@ s32 exfat_init_ext_entry(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32
 {
 	int i;
 	u32 sector;
-	u16 *uniname = p_uniname->name;
+	u16 *uniname = p_uniname->name, old_hash;
 	FILE_DENTRY_T *file_ep;
 	STRM_DENTRY_T *strm_ep;
 	NAME_DENTRY_T *name_ep;
@@ -2931,6 +3100,7 @@ s32 exfat_init_ext_entry(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32
 	if (!strm_ep)
 		return FFS_MEDIAERR;
 
+	old_hash = GET16_A(strm_ep->name_hash);
 	strm_ep->name_len = p_uniname->name_len;
 	SET16_A(strm_ep->name_hash, p_uniname->name_hash);
 	buf_modify(sb, sector);
@@ -2947,6 +3117,8 @@ s32 exfat_init_ext_entry(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32
 
 	update_dir_checksum(sb, p_dir, entry);
 
+	dentry_hash_insert(sb, p_dir, entry, num_entries, old_hash, p_uniname->name_hash);
+
 	return FFS_SUCCESS;
 } /* end of exfat_init_ext_entry */
 
@@ -3074,9 +3246,20 @@ void exfat_delete_dir_entry(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s
 {
 	int i;
 	u32 sector;
+	u16 name_hash = 0;
 	DENTRY_T *ep;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
+	if (order == 0) {
+		ep = get_entry_in_dir(sb, p_dir, entry+1, NULL);
+		if (!ep) {
+			dentry_hash_drop(sb, p_dir->dir);
+			return;
+		}
+		name_hash = GET16_A(((STRM_DENTRY_T *) ep)->name_hash);
+	}
+	dentry_hash_remove(sb, p_dir, entry, order, name_hash);
+
 	for (i = order; i < num_entries; i++) {
 		ep = get_entry_in_dir(sb, p_dir, entry+i, &sector);
 		if (!ep)
@@ -3482,6 +3665,370 @@ s32 write_partial_entries_in_entry_set (struct super_block *sb, ENTRY_SET_CACHE_
 	return __write_partial_entries_in_entry_set(sb, es, sec, off, count);
 }
 
+/*
+ *  Directory Entry Hash Functions
+ *
+ *  exfat_find_dir_entry() compares the name of every entry set in front
+ *  of the match, so each lookup in a large directory reads the whole
+ *  directory.  Once lookups have walked DENTRY_HASH_MIN_ENTRIES entries of
+ *  the same directory twice, the directory gets an in-memory index of its
+ *  file entries keyed by the name hash of their stream extension entry.
+ *  A directory that is only scanned once is never indexed, and an index
+ *  used in the last DENTRY_HASH_MIN_IDLE lookups is not evicted for a new
+ *  one, so a walk over many large directories can't flush the indexes
+ *  that are in use.  The index is updated by
+ *  exfat_init_ext_entry() and exfat_delete_dir_entry(), and remembers the
+ *  lowest entry that may be empty so that creating a file does not rescan
+ *  the directory either.  The indexes belong to the volume and are used
+ *  under v_sem.
+ *
+ *  The on-disk name hash is taken over the upcased name, but with
+ *  namecase=1 nls_upper() leaves the name alone and the hash of the name
+ *  being looked up would not match, so such volumes are never indexed.
+ */
+
+static DENTRY_HASH_T *dentry_hash_get(struct super_block *sb, u32 dir)
+{
+	int i;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	for (i = 0; i < DENTRY_HASH_NUM_DIRS; i++) {
+		if (p_fs->dentry_hash[i].dir == dir)
+			return &(p_fs->dentry_hash[i]);
+	}
+
+	return NULL;
+} /* end of dentry_hash_get */
+
+static DENTRY_HASH_NODE_T *dentry_hash_find(DENTRY_HASH_T *dh, s32 entry, u16 name_hash)
+{
+	DENTRY_HASH_NODE_T *node;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(node, pos, &dh->head[name_hash & (DENTRY_HASH_SIZE-1)], list) {
+		if (node->entry == entry)
+			return node;
+	}
+
+	return NULL;
+} /* end of dentry_hash_find */
+
+static void dentry_hash_free(DENTRY_HASH_T *dh)
+{
+	int i;
+	DENTRY_HASH_NODE_T *node;
+	struct hlist_node *pos, *n;
+
+	if (dh->head) {
+		for (i = 0; i < DENTRY_HASH_SIZE; i++) {
+			hlist_for_each_entry_safe(node, pos, n, &dh->head[i], list)
+				kmem_cache_free(dentry_hash_cachep, node);
+		}
+		kfree(dh->head);
+		dh->head = NULL;
+	}
+	dh->dir = CLUSTER_32(~0);
+} /* end of dentry_hash_free */
+
+/* remember that dir was scanned, returns TRUE if it was scanned before */
+static s32 dentry_hash_miss(struct super_block *sb, u32 dir)
+{
+	int i;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	for (i = 0; i < DENTRY_HASH_NUM_MISSES; i++) {
+		if (p_fs->dentry_hash_miss[i] == dir)
+			return TRUE;
+	}
+
+	p_fs->dentry_hash_miss[p_fs->dentry_hash_miss_idx] = dir;
+	p_fs->dentry_hash_miss_idx = (p_fs->dentry_hash_miss_idx + 1) % DENTRY_HASH_NUM_MISSES;
+	return FALSE;
+} /* end of dentry_hash_miss */
+
+static void dentry_hash_forget(struct super_block *sb, u32 dir)
+{
+	int i;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	for (i = 0; i < DENTRY_HASH_NUM_MISSES; i++) {
+		if (p_fs->dentry_hash_miss[i] == dir)
+			p_fs->dentry_hash_miss[i] = CLUSTER_32(~0);
+	}
+} /* end of dentry_hash_forget */
+
+/* index the file entries of p_dir in an unused or idle slot */
+static DENTRY_HASH_T *dentry_hash_build(struct super_block *sb, CHAIN_T *p_dir)
+{
+	int i, dentry = 0;
+	s32 file_entry = -1;
+	u32 entry_type;
+	CHAIN_T clu;
+	DENTRY_T *ep;
+	DENTRY_HASH_T *dh;
+	DENTRY_HASH_NODE_T *node;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	dh = NULL;
+	for (i = 0; i < DENTRY_HASH_NUM_DIRS; i++) {
+		if (p_fs->dentry_hash[i].dir == CLUSTER_32(~0)) {
+			dh = &(p_fs->dentry_hash[i]);
+			break;
+		}
+		if (!dh || ((p_fs->dentry_hash_lru - p_fs->dentry_hash[i].lru) >
+			    (p_fs->dentry_hash_lru - dh->lru)))
+			dh = &(p_fs->dentry_hash[i]);
+	}
+
+	/* all indexes are in use, keep scanning this directory */
+	if ((dh->dir != CLUSTER_32(~0)) &&
+		((p_fs->dentry_hash_lru - dh->lru) < DENTRY_HASH_MIN_IDLE))
+		return NULL;
+	dentry_hash_free(dh);
+
+	dh->head = kmalloc(DENTRY_HASH_SIZE * sizeof(struct hlist_head), GFP_NOFS);
+	if (!dh->head)
+		return NULL;
+
+	for (i = 0; i < DENTRY_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&dh->head[i]);
+	dh->free_entry = -1;
+
+	clu.dir = p_dir->dir;
+	clu.size = p_dir->size;
+	clu.flags = p_dir->flags;
+
+	while (clu.dir != CLUSTER_32(~0)) {
+		if (p_fs->dev_ejected)
+			goto err_out;
+
+		for (i = 0; i < p_fs->dentries_per_clu; i++, dentry++) {
+			ep = get_entry_in_dir(sb, &clu, i, NULL);
+			if (!ep)
+				goto err_out;
+
+			entry_type = p_fs->fs_func->get_entry_type(ep);
+
+			if ((entry_type == TYPE_UNUSED) || (entry_type == TYPE_DELETED)) {
+				if (dh->free_entry < 0)
+					dh->free_entry = dentry;
+				if (entry_type == TYPE_UNUSED)
+					goto out;
+				file_entry = -1;
+			} else if ((entry_type == TYPE_FILE) || (entry_type == TYPE_DIR)) {
+				file_entry = dentry;
+			} else if ((entry_type == TYPE_STREAM) && (file_entry == dentry-1)) {
+				node = kmem_cache_alloc(dentry_hash_cachep, GFP_NOFS);
+				if (!node)
+					goto err_out;
+
+				node->entry = file_entry;
+				node->name_hash = GET16_A(((STRM_DENTRY_T *) ep)->name_hash);
+				hlist_add_head(&node->list, &dh->head[node->name_hash & (DENTRY_HASH_SIZE-1)]);
+			}
+		}
+
+		if (clu.flags == 0x03) {
+			if ((--clu.size) > 0)
+				clu.dir++;
+			else
+				clu.dir = CLUSTER_32(~0);
+		} else {
+			if (FAT_read(sb, clu.dir, &(clu.dir)) != 0)
+				goto err_out;
+		}
+	}
+
+	/* no empty entry: the directory has to grow for a new file */
+	if (dh->free_entry < 0)
+		dh->free_entry = dentry;
+
+out:
+	dh->dir = p_dir->dir;
+	dh->lru = p_fs->dentry_hash_lru;
+	dentry_hash_forget(sb, p_dir->dir);
+	return dh;
+
+err_out:
+	dentry_hash_free(dh);
+	return NULL;
+} /* end of dentry_hash_build */
+
+/* compare the entry set at "entry" with p_uniname, like exfat_find_dir_entry() */
+static s32 dentry_hash_match(struct super_block *sb, CHAIN_T *p_dir, s32 entry, UNI_NAME_T *p_uniname, u32 type)
+{
+	int i, len, num_ext_entries;
+	s32 ret;
+	u32 entry_type;
+	u16 entry_uniname[16], *uniname = p_uniname->name, unichar;
+	DENTRY_T *ep;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	ep = get_entry_in_dir(sb, p_dir, entry, NULL);
+	if (!ep)
+		return FALSE;
+
+	entry_type = p_fs->fs_func->get_entry_type(ep);
+	if ((entry_type != TYPE_FILE) && (entry_type != TYPE_DIR))
+		return FALSE;
+	if ((type != TYPE_ALL) && (type != entry_type))
+		return FALSE;
+
+	num_ext_entries = ((FILE_DENTRY_T *) ep)->num_ext;
+	if (num_ext_entries < 2)
+		return FALSE;
+
+	ep = get_entry_in_dir(sb, p_dir, entry+1, NULL);
+	if (!ep || (p_fs->fs_func->get_entry_type(ep) != TYPE_STREAM))
+		return FALSE;
+	if (((STRM_DENTRY_T *) ep)->name_len != p_uniname->name_len)
+		return FALSE;
+
+	for (i = 2; i <= num_ext_entries; i++, uniname += 15) {
+		ep = get_entry_in_dir(sb, p_dir, entry+i, NULL);
+		if (!ep || (p_fs->fs_func->get_entry_type(ep) != TYPE_EXTEND))
+			return FALSE;
+
+		len = extract_uni_name_from_name_entry((NAME_DENTRY_T *) ep, entry_uniname, i);
+
+		unichar = *(uniname+len);
+		*(uniname+len) = 0x0;
+
+		ret = nls_uniname_cmp(sb, uniname, entry_uniname);
+
+		*(uniname+len) = unichar;
+
+		if (ret)
+			return FALSE;
+	}
+
+	return TRUE;
+} /* end of dentry_hash_match */
+
+static s32 dentry_hash_lookup(struct super_block *sb, CHAIN_T *p_dir, DENTRY_HASH_T *dh, UNI_NAME_T *p_uniname, u32 type)
+{
+	DENTRY_HASH_NODE_T *node;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(node, pos, &dh->head[p_uniname->name_hash & (DENTRY_HASH_SIZE-1)], list) {
+		if ((node->name_hash == p_uniname->name_hash) &&
+			dentry_hash_match(sb, p_dir, node->entry, p_uniname, type))
+			return node->entry;
+	}
+
+	return -2;
+} /* end of dentry_hash_lookup */
+
+/* point the unused entry hint at the lowest entry of p_dir that may be empty */
+static void dentry_hash_set_hint(struct super_block *sb, CHAIN_T *p_dir, DENTRY_HASH_T *dh)
+{
+	s32 off;
+	CHAIN_T clu;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	clu.dir = p_dir->dir;
+	clu.size = p_dir->size;
+	clu.flags = p_dir->flags;
+
+	off = dh->free_entry >> (p_fs->cluster_size_bits - DENTRY_SIZE_BITS);
+
+	if (clu.flags == 0x03) {
+		if (off < clu.size) {
+			clu.dir += off;
+			clu.size -= off;
+		} else {
+			clu.dir = CLUSTER_32(~0);
+		}
+	} else {
+		while ((off-- > 0) && (clu.dir != CLUSTER_32(~0))) {
+			if (FAT_read(sb, clu.dir, &(clu.dir)) != 0)
+				return;
+			clu.size--;
+		}
+	}
+
+	p_fs->hint_uentry.dir = p_dir->dir;
+	if (clu.dir == CLUSTER_32(~0)) {
+		p_fs->hint_uentry.entry = -1;
+		return;
+	}
+
+	p_fs->hint_uentry.entry = dh->free_entry;
+	p_fs->hint_uentry.clu.dir = clu.dir;
+	p_fs->hint_uentry.clu.size = clu.size;
+	p_fs->hint_uentry.clu.flags = clu.flags;
+} /* end of dentry_hash_set_hint */
+
+/* a name has been written to the entry set at "entry" */
+void dentry_hash_insert(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32 num_entries, u16 old_hash, u16 new_hash)
+{
+	DENTRY_HASH_T *dh;
+	DENTRY_HASH_NODE_T *node;
+
+	dh = dentry_hash_get(sb, p_dir->dir);
+	if (!dh)
+		return;
+
+	node = dentry_hash_find(dh, entry, old_hash);
+	if (node) {
+		hlist_del(&node->list);
+	} else {
+		node = kmem_cache_alloc(dentry_hash_cachep, GFP_NOFS);
+		if (!node) {
+			dentry_hash_free(dh);
+			return;
+		}
+	}
+
+	node->entry = entry;
+	node->name_hash = new_hash;
+	hlist_add_head(&node->list, &dh->head[new_hash & (DENTRY_HASH_SIZE-1)]);
+
+	if ((entry <= dh->free_entry) && (dh->free_entry < entry + num_entries))
+		dh->free_entry = entry + num_entries;
+} /* end of dentry_hash_insert */
+
+/* entries from "entry + order" on are being deleted */
+void dentry_hash_remove(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32 order, u16 name_hash)
+{
+	DENTRY_HASH_T *dh;
+	DENTRY_HASH_NODE_T *node;
+
+	dh = dentry_hash_get(sb, p_dir->dir);
+	if (!dh)
+		return;
+
+	if (order == 0) {
+		node = dentry_hash_find(dh, entry, name_hash);
+		if (node) {
+			hlist_del(&node->list);
+			kmem_cache_free(dentry_hash_cachep, node);
+		}
+	}
+
+	if (entry + order < dh->free_entry)
+		dh->free_entry = entry + order;
+} /* end of dentry_hash_remove */
+
+void dentry_hash_drop(struct super_block *sb, u32 dir)
+{
+	DENTRY_HASH_T *dh;
+
+	dh = dentry_hash_get(sb, dir);
+	if (dh)
+		dentry_hash_free(dh);
+	dentry_hash_forget(sb, dir);
+} /* end of dentry_hash_drop */
+
+void dentry_hash_release_all(struct super_block *sb)
+{
+	int i;
+	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
+
+	for (i = 0; i < DENTRY_HASH_NUM_DIRS; i++)
+		dentry_hash_free(&(p_fs->dentry_hash[i]));
+} /* end of dentry_hash_release_all */
+
 /* search EMPTY CONTINUOUS "num_entries" entries */
 s32 search_deleted_or_unused_entry(struct super_block *sb, CHAIN_T *p_dir, s32 num_entries)
 {
@@ -3490,6 +4037,7 @@ s32 search_deleted_or_unused_entry(struct super_block *sb, CHAIN_T *p_dir, s32 n
 	u32 type;
 	CHAIN_T clu;
 	DENTRY_T *ep;
+	DENTRY_HASH_T *dh;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	if (p_dir->dir == CLUSTER_32(0)) /* FAT16 root_dir */
@@ -3497,6 +4045,12 @@ s32 search_deleted_or_unused_entry(struct super_block *sb, CHAIN_T *p_dir, s32 n
 	else
 		dentries_per_clu = p_fs->dentries_per_clu;
 
+	if (p_fs->hint_uentry.dir != p_dir->dir) {
+		dh = dentry_hash_get(sb, p_dir->dir);
+		if (dh)
+			dentry_hash_set_hint(sb, p_dir, dh);
+	}
+
 	if (p_fs->hint_uentry.dir == p_dir->dir) {
 		if (p_fs->hint_uentry.entry == -1)
 			return -1;
@@ -3759,7 +4313,7 @@ s32 fat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_uni
 s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_uniname, s32 num_entries, DOS_NAME_T *p_dosname, u32 type)
 {
 	int i, dentry = 0, num_ext_entries = 0, len;
-	s32 order = 0, is_feasible_entry = FALSE;
+	s32 ret = -2, order = 0, is_feasible_entry = FALSE;
 	s32 dentries_per_clu, num_empty = 0;
 	u32 entry_type;
 	u16 entry_uniname[16], *uniname = NULL, unichar;
@@ -3768,6 +4322,7 @@ s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_u
 	FILE_DENTRY_T *file_ep;
 	STRM_DENTRY_T *strm_ep;
 	NAME_DENTRY_T *name_ep;
+	DENTRY_HASH_T *dh;
 	FS_INFO_T *p_fs = &(EXFAT_SB(sb)->fs_info);
 
 	if (p_dir->dir == p_fs->root_dir) {
@@ -3776,6 +4331,22 @@ s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_u
 			return -1; // special case, root directory itself
 	}
 
+	p_fs->dentry_hash_lru++;
+
+	dh = dentry_hash_get(sb, p_dir->dir);
+	if (dh) {
+		dh->lru = p_fs->dentry_hash_lru;
+
+		ret = dentry_hash_lookup(sb, p_dir, dh, p_uniname, type);
+		if (ret >= 0) {
+			p_fs->hint_uentry.dir = CLUSTER_32(~0);
+			p_fs->hint_uentry.entry = -1;
+		} else {
+			dentry_hash_set_hint(sb, p_dir, dh);
+		}
+		return ret;
+	}
+
 	if (p_dir->dir == CLUSTER_32(0)) /* FAT16 root_dir */
 		dentries_per_clu = p_fs->dentries_in_root;
 	else
@@ -3815,7 +4386,7 @@ s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_u
 				}
 
 				if (entry_type == TYPE_UNUSED)
-					return -2;
+					goto out;
 			} else {
 				num_empty = 0;
 
@@ -3855,7 +4426,8 @@ s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_u
 						} else if (order == num_ext_entries) {
 							p_fs->hint_uentry.dir = CLUSTER_32(~0);
 							p_fs->hint_uentry.entry = -1;
-							return dentry - (num_ext_entries);
+							ret = dentry - (num_ext_entries);
+							goto out;
 						}
 
 						*(uniname+len) = unichar;
@@ -3880,7 +4452,13 @@ s32 exfat_find_dir_entry(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_u
 		}
 	}
 
-	return -2;
+out:
+	/* a large directory scanned again goes through the hash next time */
+	if ((dentry >= DENTRY_HASH_MIN_ENTRIES) && !EXFAT_SB(sb)->options.casesensitive &&
+		dentry_hash_miss(sb, p_dir->dir))
+		dentry_hash_build(sb, p_dir);
+
+	return ret;
 } /* end of exfat_find_dir_entry */
 
 /* returns -1 on error */
@@ -4442,9 +5020,9 @@ s32 resolve_path(struct inode *inode, char *path, CHAIN_T *p_dir, UNI_NAME_T *p_
 	if (strlen(path) >= (MAX_NAME_LENGTH * MAX_CHARSET_SIZE))
 		return FFS_INVALIDPATH;
 
-	strcpy(name_buf, path);
+	strcpy(p_fs->name_buf, path);
 
-	nls_cstring_to_uniname(sb, p_uniname, name_buf, &lossy);
+	nls_cstring_to_uniname(sb, p_uniname, p_fs->name_buf, &lossy);
 	if (lossy)
 		return FFS_INVALIDPATH;
 
@@ -4658,6 +5236,7 @@ s32 exfat_mount(struct super_block *sb, PBR_SECTOR_T *p_pbr)
 	p_fs->vol_flag = (u32) GET16(p_bpb->vol_flags);
 	p_fs->clu_srch_ptr = 2;
 	p_fs->used_clusters = (u32) ~0;
+	p_fs->alloc_run_fail = 0;
 
 	p_fs->fs_func = &exfat_fs_func;
 
@@ -85,6 +85,18 @@
 #define FAT32_THRESHOLD         268435457   /* 2^28 - 1 + 2 */
 #define EXFAT_THRESHOLD         268435457   /* 2^28 - 1 + 2 */
 
+/* directory entry hash */
+#define DENTRY_HASH_BITS        10
+#define DENTRY_HASH_SIZE        (1 << DENTRY_HASH_BITS)
+#define DENTRY_HASH_NUM_DIRS    4           /* indexed dirs per volume */
+#define DENTRY_HASH_MIN_ENTRIES 256         /* index dirs scanned past this */
+#define DENTRY_HASH_NUM_MISSES  8           /* large dirs scanned only once */
+#define DENTRY_HASH_MIN_IDLE    64          /* lookups before an index is evicted */
+
+/* minimum free run (log2 bytes) used to place a new or relocated chain */
+#define ALLOC_RUN_SIZE_BITS     20          /* 1MB */
+#define ALLOC_RUN_SCAN_SECTORS  8           /* bitmap sectors searched */
+
 /* file types */
 #define TYPE_UNUSED             0x0000
 #define TYPE_DELETED            0x0001
@@ -415,6 +427,20 @@ typedef struct {
 	CHAIN_T     clu;
 } UENTRY_T;
 
+/* name hash index of a directory (exFAT only) */
+typedef struct {
+	struct hlist_node list;
+	s32       entry;                 /* position of the file entry */
+	u16      name_hash;
+} DENTRY_HASH_NODE_T;
+
+typedef struct {
+	u32      dir;                    /* start cluster, ~0 if unused */
+	u32      lru;
+	s32       free_entry;            /* no empty entry before this one */
+	struct hlist_head *head;
+} DENTRY_HASH_T;
+
 typedef struct {
 	s32       (*alloc_cluster)(struct super_block *sb, s32 num_alloc, CHAIN_T *p_chain);
 	void        (*free_cluster)(struct super_block *sb, CHAIN_T *p_chain, s32 do_relse);
@@ -478,12 +504,21 @@ typedef struct __FS_INFO_T {
 
 	u32      clu_srch_ptr;           /* cluster search pointer */
 	u32      used_clusters;          /* number of used clusters */
+	u32      alloc_run_fail;         /* run size not found since last free */
 	UENTRY_T    hint_uentry;         /* unused entry hint information */
+	DENTRY_HASH_T dentry_hash[DENTRY_HASH_NUM_DIRS]; /* name hash indexes */
+	u32      dentry_hash_lru;          /* lookup count */
+	u32      dentry_hash_miss[DENTRY_HASH_NUM_MISSES]; /* dirs to index next */
+	u32      dentry_hash_miss_idx;
 
 	u32      dev_ejected;            /* block device operation error flag */
 
 	FS_FUNC_T	*fs_func;
 	struct semaphore v_sem;
+	struct semaphore f_sem;          /* FAT cache lock */
+
+	/* path conversion buffer, used under v_sem */
+	u8 name_buf[MAX_PATH_LENGTH * MAX_CHARSET_SIZE];
 
 	/* FAT cache */
 	BUF_CACHE_T FAT_cache_array[FAT_CACHE_SIZE];
@@ -536,7 +571,7 @@ s32 ffsRemoveFile(struct inode *inode, FILE_ID_T *fid);
 s32 ffsSetAttr(struct inode *inode, u32 attr);
 s32 ffsGetStat(struct inode *inode, DIR_ENTRY_T *info);
 s32 ffsSetStat(struct inode *inode, DIR_ENTRY_T *info);
-s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu);
+s32 ffsMapCluster(struct inode *inode, s32 clu_offset, u32 *clu, int create);
 
 /* directory management functions */
 s32 ffsCreateDir(struct inode *inode, char *path, FILE_ID_T *fid);
@@ -570,8 +605,11 @@ void   exfat_chain_cont_cluster(struct super_block *sb, u32 chain, s32 len);
 s32  load_alloc_bitmap(struct super_block *sb);
 void   free_alloc_bitmap(struct super_block *sb);
 s32   set_alloc_bitmap(struct super_block *sb, u32 clu);
+s32   set_alloc_bitmap_range(struct super_block *sb, u32 clu, u32 count);
 s32   clr_alloc_bitmap(struct super_block *sb, u32 clu);
 u32 test_alloc_bitmap(struct super_block *sb, u32 clu);
+u32 scan_alloc_bitmap(struct super_block *sb, u32 clu, u32 end, s32 want_free);
+u32 find_free_run(struct super_block *sb, u32 clu, u32 want, u32 *len);
 void   sync_alloc_bitmap(struct super_block *sb);
 
 /* upcase table management functions */
@@ -633,6 +671,12 @@ void   update_dir_checksum(struct super_block *sb, CHAIN_T *p_dir, s32 entry);
 void update_dir_checksum_with_entry_set(struct super_block *sb, ENTRY_SET_CACHE_T *es);
 bool   is_dir_empty(struct super_block *sb, CHAIN_T *p_dir);
 
+/* directory entry hash functions */
+void   dentry_hash_insert(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32 num_entries, u16 old_hash, u16 new_hash);
+void   dentry_hash_remove(struct super_block *sb, CHAIN_T *p_dir, s32 entry, s32 order, u16 name_hash);
+void   dentry_hash_drop(struct super_block *sb, u32 dir);
+void   dentry_hash_release_all(struct super_block *sb);
+
 /* name conversion functions */
 s32  get_num_entries_and_dos_name(struct super_block *sb, CHAIN_T *p_dir, UNI_NAME_T *p_uniname, s32 *entries, DOS_NAME_T *p_dosname);
 void   get_uni_name_from_dos_entry(struct super_block *sb, DOS_DENTRY_T *ep, UNI_NAME_T *p_uniname, u8 mode);
@@ -55,8 +55,6 @@
 /*                                                                      */
 /*======================================================================*/
 
-DEFINE_SEMAPHORE(z_sem);
-
 s32 sm_init(struct semaphore *sm)
 {
 	sema_init(sm, 1);
@@ -837,7 +837,10 @@ static int exfat_unlink(struct inode *dir, struct dentry *dentry)
 
 	EXFAT_I(inode)->fid.size = i_size_read(inode);
 
+	/* the chain is freed under readers mapping the inode in get_block */
+	mutex_lock(&EXFAT_I(inode)->map_lock);
 	err = FsRemoveFile(dir, &(EXFAT_I(inode)->fid));
+	mutex_unlock(&EXFAT_I(inode)->map_lock);
 	if (err) {
 #ifdef CONFIG_GOD_MODE
 if (!god_mode_enabled) {
@@ -1504,9 +1507,10 @@ static int exfat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
 	clu_offset = sector >> p_fs->sectors_per_clu_bits;  /* cluster offset */
 	sec_offset = sector & (p_fs->sectors_per_clu - 1);  /* sector offset in cluster */
 
-	EXFAT_I(inode)->fid.size = i_size_read(inode);
+	if (*create)
+		EXFAT_I(inode)->fid.size = i_size_read(inode);
 
-	err = FsMapCluster(inode, clu_offset, &cluster);
+	err = FsMapCluster(inode, clu_offset, &cluster, *create);
 
 	if (err) {
 		if (err == FFS_FULL)
@@ -1526,15 +1530,27 @@ static int exfat_get_block(struct inode *inode, sector_t iblock,
 {
 	struct super_block *sb = inode->i_sb;
 	unsigned long max_blocks = bh_result->b_size >> inode->i_blkbits;
-	int err;
+	int err, locked;
 	unsigned long mapped_blocks;
 	sector_t phys;
 
-	__lock_super(sb);
+	/*
+	 * Blocks inside i_size are already allocated, and mapping them
+	 * only walks the inode's cluster chain under its map_lock.  The
+	 * superblock lock is needed only when a cluster may be allocated,
+	 * so that reads of different files can run concurrently.
+	 */
+	if (iblock < ((i_size_read(inode) + sb->s_blocksize - 1) >> sb->s_blocksize_bits))
+		create = 0;
+
+	locked = create;
+	if (locked)
+		__lock_super(sb);
 
 	err = exfat_bmap(inode, iblock, &phys, &mapped_blocks, &create);
 	if (err) {
-		__unlock_super(sb);
+		if (locked)
+			__unlock_super(sb);
 		return err;
 	}
 
@@ -1548,7 +1564,8 @@ static int exfat_get_block(struct inode *inode, sector_t iblock,
 	}
 
 	bh_result->b_size = max_blocks << sb->s_blocksize_bits;
-	__unlock_super(sb);
+	if (locked)
+		__unlock_super(sb);
 
 	return 0;
 }
@@ -1895,6 +1912,7 @@ static struct inode *exfat_alloc_inode(struct super_block *sb)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,4,00)
 	init_rwsem(&ei->truncate_lock);
 #endif
+	mutex_init(&ei->map_lock);
 
 	return &ei->vfs_inode;
 }
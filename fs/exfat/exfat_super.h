@@ -107,6 +107,7 @@ struct exfat_inode_info {
 	loff_t i_pos;               /* on-disk position of directory entry or 0 */
 	struct hlist_node i_hash_fat;	/* hash by i_location */
 	struct rw_semaphore truncate_lock;
+	struct mutex map_lock;      /* protect fid cluster chain for bmap */
 	struct inode vfs_inode;
 	struct rw_semaphore i_alloc_sem; /* protect bmap against truncate */
 };
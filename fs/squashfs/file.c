@@ -47,6 +47,8 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -371,11 +373,89 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Decompress a datablock straight into the page cache pages it covers,
+ * rather than into the read_page cache and copying out from there.
+ * This is only done if every page of the block can be grabbed and none
+ * of them is already uptodate.  If not, -EAGAIN is returned with
+ * @target_page still locked and the caller falls back to the cache.
+ * On success all pages, @target_page included, are uptodate and
+ * unlocked; on error @target_page is left locked for the caller.
+ */
+static int squashfs_readpage_direct(struct page *target_page, u64 block,
+	int bsize, int expected)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int pages = (expected + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+	int i, n, res = -EAGAIN;
+	struct page **page;
+	void **buffer, *pageaddr = NULL;
+
+	page = kmalloc(pages * (sizeof(*page) + sizeof(*buffer)), GFP_KERNEL);
+	if (page == NULL)
+		return -EAGAIN;
+	buffer = (void **) (page + pages);
+
+	for (i = 0, n = start_index; i < pages; i++, n++) {
+		if (n == target_page->index) {
+			page[i] = target_page;
+			continue;
+		}
+
+		page[i] = grab_cache_page_nowait(target_page->mapping, n);
+		if (page[i] == NULL)
+			goto release;
+
+		if (PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			goto release;
+		}
+	}
+
+	pageaddr = vmap(page, pages, VM_MAP, PAGE_KERNEL);
+	if (pageaddr == NULL)
+		goto release;
+
+	for (n = 0; n < pages; n++)
+		buffer[n] = pageaddr + (n << PAGE_CACHE_SHIFT);
+
+	res = squashfs_read_data(inode->i_sb, buffer, block, bsize, NULL,
+		pages << PAGE_CACHE_SHIFT, pages);
+	if (res >= 0) {
+		/* Last page may have trailing bytes not filled */
+		memset(pageaddr + res, 0, (pages << PAGE_CACHE_SHIFT) - res);
+		res = 0;
+	}
+
+	flush_kernel_vmap_range(pageaddr, pages << PAGE_CACHE_SHIFT);
+	vunmap(pageaddr);
+
+release:
+	for (n = 0; n < i; n++) {
+		if (res == 0) {
+			flush_dcache_page(page[n]);
+			SetPageUptodate(page[n]);
+		} else if (page[n] == target_page)
+			continue;
+		unlock_page(page[n]);
+		if (page[n] != target_page)
+			page_cache_release(page[n]);
+	}
+
+	kfree(page);
+	return res;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
+	int bytes, i, offset = 0, sparse = 0, res;
 	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
 
@@ -409,6 +489,21 @@ static int squashfs_readpage(struct file *file, struct page *page)
 				 msblk->block_size;
 			sparse = 1;
 		} else {
+			int expected = index == file_end ?
+				(i_size_read(inode) & (msblk->block_size - 1)) :
+				 msblk->block_size;
+
+			/*
+			 * Try to decompress the datablock directly into the
+			 * page cache first.
+			 */
+			res = squashfs_readpage_direct(page, block, bsize,
+								expected);
+			if (res == 0)
+				return 0;
+			else if (res != -EAGAIN)
+				goto error_out;
+
 			/*
 			 * Read and decompress datablock.
 			 */
@@ -61,6 +61,7 @@ struct ion_heap;
 struct ion_mapper;
 struct ion_client;
 struct ion_buffer;
+struct dma_buf;
 
 /* This should be removed some day when phys_addr_t's are fully
    plumbed in the kernel, and all instances of ion_phys_addr_t should
@@ -244,6 +245,18 @@ struct ion_buffer *ion_share(struct ion_client *client,
 struct ion_handle *ion_import(struct ion_client *client,
 			      struct ion_buffer *buffer);
 
+/**
+ * ion_share_dma_buf() - given a handle, export it as a dma_buf
+ * @client:	the client
+ * @handle:	the handle to share
+ *
+ * Given a handle, return a dma_buf holding its own reference to the
+ * buffer, which other drivers can attach to and map with the dma_buf
+ * api.  Release it with dma_buf_put.
+ */
+struct dma_buf *ion_share_dma_buf(struct ion_client *client,
+				  struct ion_handle *handle);
+
 /**
  * ion_share_fd() - given a handle, obtain a buffer(fd) to pass to userspace
  * @client:	the client
@@ -251,10 +264,23 @@ struct ion_handle *ion_import(struct ion_client *client,
  *
  * Given a handle, return a fd of a buffer which can be passed to userspace.
  * Should be passed into userspace or ion_import_fd to obtain a new handle for
- * this buffer.
+ * this buffer.  The fd is a dma_buf fd, so it can also be handed to any
+ * driver importing dma_bufs.
  */
 int ion_share_fd(struct ion_client *client, struct ion_handle *handle);
 
+/**
+ * ion_import_dma_buf() - given a dma_buf exported by ion, import it
+ * @client:	this blocks client
+ * @dmabuf:	the dma_buf, as obtained from ion_share_dma_buf or dma_buf_get
+ *
+ * Returns the handle to use to refer to the underlying buffer, or
+ * -EINVAL if the dma_buf was not exported by ion.  The caller keeps its
+ * reference to the dma_buf.
+ */
+struct ion_handle *ion_import_dma_buf(struct ion_client *client,
+				      struct dma_buf *dmabuf);
+
 /**
  * ion_import_fd() - given an fd obtained via ION_IOC_SHARE ioctl, import it
  * @client:	this blocks client
@@ -395,7 +421,8 @@ struct ion_custom_data {
  * opaque handle.  Returns the struct with the fd field set to a file
  * descriptor open in the current address space.  This file descriptor
  * can then be passed to another process.  The corresponding opaque handle can
- * be retrieved via ION_IOC_IMPORT.
+ * be retrieved via ION_IOC_IMPORT.  The fd is a dma_buf, so it can also be
+ * passed directly to drivers that import dma_bufs.
  */
 #define ION_IOC_SHARE		_IOWR(ION_IOC_MAGIC, 4, struct ion_fd_data)
 
@@ -408,6 +435,16 @@ struct ion_custom_data {
  */
 #define ION_IOC_IMPORT		_IOWR(ION_IOC_MAGIC, 5, int)
 
+/**
+ * DOC: ION_IOC_DRAIN - wait for deferred frees to complete
+ *
+ * Heaps may free buffers asynchronously after the last reference is
+ * dropped.  This frees everything still queued on the heaps the client
+ * can allocate from and returns once that memory is back in its heap.
+ * Takes no argument.
+ */
+#define ION_IOC_DRAIN		_IO(ION_IOC_MAGIC, 7)
+
 /**
  * DOC: ION_IOC_CUSTOM - call architecture specific ion ioctl
  *
@@ -67,6 +67,25 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The lowmemorykiller keeps thread groups sorted by oom_score_adj so it
+ * does not have to walk every task to find a victim.  Anything changing
+ * signal->oom_score_adj of a live group must bracket the store with
+ * lowmem_adj_tree_del()/lowmem_adj_tree_add() under the group's siglock.
+ */
+#ifdef CONFIG_ANDROID_LMK_ADJ_RBTREE
+extern void lowmem_adj_tree_add(struct task_struct *task);
+extern void lowmem_adj_tree_del(struct task_struct *task);
+#else
+static inline void lowmem_adj_tree_add(struct task_struct *task)
+{
+}
+
+static inline void lowmem_adj_tree_del(struct task_struct *task)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
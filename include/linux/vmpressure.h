@@ -0,0 +1,75 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/eventfd.h>
+#include <linux/cgroup.h>
+
+/*
+ * Memory pressure levels, derived from the reclaim efficiency (the ratio
+ * of pages reclaimed to pages scanned) over a window of scanned pages.
+ */
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+struct vmpressure {
+	unsigned long scanned;
+	unsigned long reclaimed;
+	/* Keeps scanned and reclaimed above in sync. */
+	spinlock_t sr_lock;
+
+	/* The list of vmpressure_event structs. */
+	struct list_head events;
+	/* Have to grab the lock on events traversal or modifications. */
+	struct mutex events_lock;
+
+	struct work_struct work;
+};
+
+struct mem_cgroup;
+
+/*
+ * Notifier callbacks run from process context, once per window, with
+ * the level as @action and a pointer to the pressure (0-100) as @data.
+ */
+extern int vmpressure_notifier_register(struct notifier_block *nb);
+extern int vmpressure_notifier_unregister(struct notifier_block *nb);
+
+extern void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		       unsigned long scanned, unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio);
+
+extern void vmpressure_init(struct vmpressure *vmpr);
+extern void vmpressure_cleanup(struct vmpressure *vmpr);
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+/*
+ * The root cgroup and global reclaim share one vmpressure, so
+ * memcg_to_vmpressure() returns NULL for the root (and a NULL memcg).
+ */
+extern struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg);
+extern struct mem_cgroup *vmpressure_to_memcg(struct vmpressure *vmpr);
+
+extern int vmpressure_register_event(struct cgroup *cg, struct cftype *cft,
+				     struct eventfd_ctx *eventfd,
+				     const char *args);
+extern void vmpressure_unregister_event(struct cgroup *cg, struct cftype *cft,
+					struct eventfd_ctx *eventfd);
+#else
+static inline struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg)
+{
+	return NULL;
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR */
+
+#endif /* __LINUX_VMPRESSURE_H */
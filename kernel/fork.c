@@ -1520,6 +1520,7 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 			list_add_tail(&p->sibling, &p->real_parent->children);
 			list_add_tail_rcu(&p->tasks, &init_task.tasks);
 			__this_cpu_inc(process_counts);
+			lowmem_adj_tree_add(p);
 		} else {
 			current->signal->nr_threads++;
 			atomic_inc(&current->signal->live);
@@ -189,6 +189,31 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/*
+ * Whether ksmd backs off while batches merge nothing or the CPUs are
+ * busy, and speeds back up to sleep_millisecs once merges are found.
+ */
+static bool ksm_adaptive_scan = true;
+
+/* Milliseconds ksmd currently sleeps between batches when adaptive */
+static unsigned int ksm_adaptive_sleep_millisecs = 20;
+
+/* Back off to at most sleep_millisecs << KSM_ADAPTIVE_MAX_SHIFT */
+#define KSM_ADAPTIVE_MAX_SHIFT	6
+
+/* Whether empty pages are merged with the zero page, bypassing the trees */
+static bool ksm_use_zero_pages = true;
+
+/* Checksum of an empty page, to track empty pages across scans */
+static u32 zero_checksum __read_mostly;
+
+/* Per-reason scan counters, only updated by ksmd */
+static unsigned long ksm_pages_scanned;
+static unsigned long ksm_merged_zero;
+static unsigned long ksm_merged_stable;
+static unsigned long ksm_merged_unstable;
+static unsigned long ksm_skipped_volatile;
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
@@ -700,6 +725,15 @@ static inline int pages_identical(struct page *page1, struct page *page2)
 	return !memcmp_pages(page1, page2);
 }
 
+static bool page_is_zero_filled(struct page *page)
+{
+	void *addr = kmap_atomic(page);
+	bool ret = !memchr_inv(addr, 0, PAGE_SIZE);
+
+	kunmap_atomic(addr);
+	return ret;
+}
+
 static int write_protect_page(struct vm_area_struct *vma, struct page *page,
 			      pte_t *orig_pte)
 {
@@ -773,6 +807,7 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 	pud_t *pud;
 	pmd_t *pmd;
 	pte_t *ptep;
+	pte_t newpte;
 	spinlock_t *ptl;
 	unsigned long addr;
 	int err = -EFAULT;
@@ -800,12 +835,24 @@ static int replace_page(struct vm_area_struct *vma, struct page *page,
 		goto out;
 	}
 
-	get_page(kpage);
-	page_add_anon_rmap(kpage, vma, addr);
+	if (kpage != ZERO_PAGE(addr)) {
+		get_page(kpage);
+		page_add_anon_rmap(kpage, vma, addr);
+		newpte = mk_pte(kpage, vma->vm_page_prot);
+	} else {
+		/*
+		 * The zero page is mapped like do_anonymous_page() maps it
+		 * on a read fault: no rmap, no refcount, and no longer an
+		 * anonymous page as far as the rss counters are concerned.
+		 */
+		newpte = pte_mkspecial(pfn_pte(page_to_pfn(kpage),
+					       vma->vm_page_prot));
+		dec_mm_counter(mm, MM_ANONPAGES);
+	}
 
 	flush_cache_page(vma, addr, pte_pfn(*ptep));
 	ptep_clear_flush(vma, addr, ptep);
-	set_pte_at_notify(mm, addr, ptep, mk_pte(kpage, vma->vm_page_prot));
+	set_pte_at_notify(mm, addr, ptep, newpte);
 
 	page_remove_rmap(page);
 	if (!page_mapped(page))
@@ -947,6 +994,28 @@ out:
 	return err;
 }
 
+/*
+ * try_to_merge_zero_page - map the zero page in place of an empty page.
+ *
+ * This function returns 0 if the page was replaced, -EFAULT otherwise.
+ */
+static int try_to_merge_zero_page(struct rmap_item *rmap_item,
+				  struct page *page)
+{
+	struct mm_struct *mm = rmap_item->mm;
+	struct vm_area_struct *vma;
+	int err = -EFAULT;
+
+	down_read(&mm->mmap_sem);
+	vma = find_mergeable_vma(mm, rmap_item->address);
+	/* The zero page cannot be mlocked */
+	if (vma && !(vma->vm_flags & VM_LOCKED))
+		err = try_to_merge_one_page(vma, page,
+					    ZERO_PAGE(rmap_item->address));
+	up_read(&mm->mmap_sem);
+	return err;
+}
+
 /*
  * try_to_merge_two_pages - take two identical pages and prepare them
  * to be merged into one page.
@@ -1183,6 +1252,23 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 
 	remove_rmap_item_from_tree(rmap_item);
 
+	/*
+	 * An empty page needs no tree search at all: once it has stayed
+	 * empty for a full scan, just map the zero page in its place.
+	 * If that fails, fall back to the trees as for any other page.
+	 */
+	if (ksm_use_zero_pages && !PageKsm(page) && page_is_zero_filled(page)) {
+		if (rmap_item->oldchecksum != zero_checksum) {
+			rmap_item->oldchecksum = zero_checksum;
+			ksm_skipped_volatile++;
+			return;
+		}
+		if (!try_to_merge_zero_page(rmap_item, page)) {
+			ksm_merged_zero++;
+			return;
+		}
+	}
+
 	/* We first start with searching the page inside the stable tree */
 	kpage = stable_tree_search(page);
 	if (kpage) {
@@ -1195,6 +1281,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			lock_page(kpage);
 			stable_tree_append(rmap_item, page_stable_node(kpage));
 			unlock_page(kpage);
+			ksm_merged_stable++;
 		}
 		put_page(kpage);
 		return;
@@ -1209,6 +1296,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	checksum = calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
+		ksm_skipped_volatile++;
 		return;
 	}
 
@@ -1231,6 +1319,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node);
 				stable_tree_append(rmap_item, stable_node);
+				ksm_merged_unstable++;
 			}
 			unlock_page(kpage);
 
@@ -1421,6 +1510,7 @@ static void ksm_do_scan(unsigned int scan_npages)
 		rmap_item = scan_get_next_rmap_item(&page);
 		if (!rmap_item)
 			return;
+		ksm_pages_scanned++;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
 			cmp_and_merge_page(page, rmap_item);
 		put_page(page);
@@ -1432,20 +1522,80 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
+static unsigned long ksm_merged(void)
+{
+	return ksm_merged_zero + ksm_merged_stable + ksm_merged_unstable;
+}
+
+/*
+ * ksm_adapt_sleep - pick the sleep before the next batch from the yield
+ * of the last one: back off exponentially while nothing is merging or
+ * the CPUs have more runnable tasks than they can run, and drop quickly
+ * back to sleep_millisecs once merges turn up again.
+ */
+static void ksm_adapt_sleep(unsigned long merged)
+{
+	unsigned int base = ksm_thread_sleep_millisecs;
+	unsigned int sleep = ksm_adaptive_sleep_millisecs;
+	unsigned int max_sleep;
+
+	max_sleep = max(base, 1U) << KSM_ADAPTIVE_MAX_SHIFT;
+	if (base > max_sleep)		/* shift overflowed */
+		max_sleep = base;
+
+	if (!merged || nr_running() > num_online_cpus())
+		sleep = min(max(sleep, 1U) * 2, max_sleep);
+	else
+		sleep /= 4;
+	ksm_adaptive_sleep_millisecs = clamp(sleep, base, max_sleep);
+}
+
+static void ksm_sleep_wakeup(unsigned long data)
+{
+	wake_up_process((struct task_struct *)data);
+}
+
+/*
+ * Sleep between adaptive batches on a deferrable timer, so an idle CPU
+ * is not woken up just to scan: the batch then runs on its next wakeup.
+ */
+static void ksm_sleep_deferrable(unsigned long timeout)
+{
+	struct timer_list timer;
+
+	setup_deferrable_timer_on_stack(&timer, ksm_sleep_wakeup,
+					(unsigned long)current);
+	set_current_state(TASK_INTERRUPTIBLE);
+	mod_timer(&timer, jiffies + timeout);
+	if (!kthread_should_stop())
+		schedule();
+	__set_current_state(TASK_RUNNING);
+	del_singleshot_timer_sync(&timer);
+	destroy_timer_on_stack(&timer);
+}
+
 static int ksm_scan_thread(void *nothing)
 {
+	unsigned long merged;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
 		mutex_lock(&ksm_thread_mutex);
-		if (ksmd_should_run())
+		if (ksmd_should_run()) {
+			merged = ksm_merged();
 			ksm_do_scan(ksm_thread_pages_to_scan);
+			ksm_adapt_sleep(ksm_merged() - merged);
+		}
 		mutex_unlock(&ksm_thread_mutex);
 
 		try_to_freeze();
 
-		if (ksmd_should_run()) {
+		if (ksmd_should_run() && ksm_adaptive_scan) {
+			ksm_sleep_deferrable(
+				msecs_to_jiffies(ksm_adaptive_sleep_millisecs));
+		} else if (ksmd_should_run()) {
 			schedule_timeout_interruptible(
 				msecs_to_jiffies(ksm_thread_sleep_millisecs));
 		} else {
@@ -1848,11 +1998,69 @@ static ssize_t sleep_millisecs_store(struct kobject *kobj,
 		return -EINVAL;
 
 	ksm_thread_sleep_millisecs = msecs;
+	ksm_adaptive_sleep_millisecs = msecs;
 
 	return count;
 }
 KSM_ATTR(sleep_millisecs);
 
+static ssize_t adaptive_scan_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_adaptive_scan);
+}
+
+static ssize_t adaptive_scan_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	unsigned long flags;
+	int err;
+
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
+
+	ksm_adaptive_scan = flags;
+	ksm_adaptive_sleep_millisecs = ksm_thread_sleep_millisecs;
+
+	return count;
+}
+KSM_ATTR(adaptive_scan);
+
+static ssize_t current_sleep_millisecs_show(struct kobject *kobj,
+					    struct kobj_attribute *attr,
+					    char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_adaptive_scan ?
+		       ksm_adaptive_sleep_millisecs :
+		       ksm_thread_sleep_millisecs);
+}
+KSM_ATTR_RO(current_sleep_millisecs);
+
+static ssize_t use_zero_pages_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_use_zero_pages);
+}
+
+static ssize_t use_zero_pages_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	unsigned long flags;
+	int err;
+
+	err = strict_strtoul(buf, 10, &flags);
+	if (err || flags > 1)
+		return -EINVAL;
+
+	ksm_use_zero_pages = flags;
+
+	return count;
+}
+KSM_ATTR(use_zero_pages);
+
 static ssize_t pages_to_scan_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
@@ -1971,6 +2179,41 @@ static ssize_t full_scans_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t pages_scanned_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_scanned);
+}
+KSM_ATTR_RO(pages_scanned);
+
+static ssize_t merged_zero_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_merged_zero);
+}
+KSM_ATTR_RO(merged_zero);
+
+static ssize_t merged_stable_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_merged_stable);
+}
+KSM_ATTR_RO(merged_stable);
+
+static ssize_t merged_unstable_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_merged_unstable);
+}
+KSM_ATTR_RO(merged_unstable);
+
+static ssize_t skipped_volatile_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_skipped_volatile);
+}
+KSM_ATTR_RO(skipped_volatile);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
@@ -1980,6 +2223,14 @@ static struct attribute *ksm_attrs[] = {
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&adaptive_scan_attr.attr,
+	&current_sleep_millisecs_attr.attr,
+	&use_zero_pages_attr.attr,
+	&pages_scanned_attr.attr,
+	&merged_zero_attr.attr,
+	&merged_stable_attr.attr,
+	&merged_unstable_attr.attr,
+	&skipped_volatile_attr.attr,
 	NULL,
 };
 
@@ -1998,6 +2249,8 @@ static int __init ksm_init(void)
 	if (err)
 		goto out;
 
+	zero_checksum = calc_checksum(ZERO_PAGE(0));
+
 	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
 	if (IS_ERR(ksm_thread)) {
 		printk(KERN_ERR "ksm: creating kthread failed\n");
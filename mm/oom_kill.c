@@ -58,8 +58,11 @@ void compare_swap_oom_score_adj(int old_val, int new_val)
 	struct sighand_struct *sighand = current->sighand;
 
 	spin_lock_irq(&sighand->siglock);
-	if (current->signal->oom_score_adj == old_val)
+	if (current->signal->oom_score_adj == old_val) {
+		lowmem_adj_tree_del(current);
 		current->signal->oom_score_adj = new_val;
+		lowmem_adj_tree_add(current);
+	}
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
 }
@@ -79,7 +82,9 @@ int test_set_oom_score_adj(int new_val)
 
 	spin_lock_irq(&sighand->siglock);
 	old_val = current->signal->oom_score_adj;
+	lowmem_adj_tree_del(current);
 	current->signal->oom_score_adj = new_val;
+	lowmem_adj_tree_add(current);
 	trace_oom_score_adj_update(current);
 	spin_unlock_irq(&sighand->siglock);
 
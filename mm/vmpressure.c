@@ -0,0 +1,371 @@
+/*
+ * Linux VM pressure
+ *
+ * Reclaim reports how many pages it scanned and how many of those it
+ * managed to reclaim.  When reclaim becomes inefficient (most scanned
+ * pages cannot be freed) the system is under memory pressure, long
+ * before free memory actually runs out.  This file accumulates those
+ * numbers over a window of scanned pages and turns them into one of a
+ * few pressure levels which interested parties are notified about.
+ *
+ * In-kernel users (the Android lowmemorykiller) subscribe to global
+ * pressure through a notifier chain.  Userspace registers an eventfd
+ * against memory.pressure_level of a memory cgroup (or of the root,
+ * which stands for global reclaim) through cgroup.event_control, see
+ * Documentation/cgroups/memory.txt.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/memcontrol.h>
+#include <linux/vmpressure.h>
+
+/*
+ * The window size is the number of scanned pages before we try to
+ * analyze the scanned/reclaimed ratio.  Using a small window would
+ * cause a lot of false positives, and too big a window would delay
+ * the notifications.  SWAP_CLUSTER_MAX * 16 is 2MB with 4K pages,
+ * which is also the granularity reclaim itself works at.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/*
+ * These thresholds are used when we account memory pressure through the
+ * scanned/reclaimed ratio.  The current values were chosen empirically:
+ * at 60% the system is already noticeably thrashing, and at 95% it is
+ * close to OOM.
+ */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * When there are too few pages left to scan, vmpressure() may miss the
+ * critical pressure as the number of pages will be less than the window
+ * size.  Instead, use the scanning priority (the log of the fraction of
+ * the LRU scanned in one pass) and treat anything that gets down to
+ * scanning a tenth of the LRU as critical.
+ */
+static const unsigned int vmpressure_level_critical_prio = ilog2(100 / 10);
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_register);
+
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_unregister);
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+struct vmpressure_event {
+	struct eventfd_ctx *efd;
+	enum vmpressure_levels level;
+	struct list_head node;
+};
+
+static void vmpressure_work_fn(struct work_struct *work);
+
+/* Reclaim can run very early, so this must not depend on an initcall. */
+static struct vmpressure global_vmpressure = {
+	.sr_lock = __SPIN_LOCK_UNLOCKED(global_vmpressure.sr_lock),
+	.events = LIST_HEAD_INIT(global_vmpressure.events),
+	.events_lock = __MUTEX_INITIALIZER(global_vmpressure.events_lock),
+	.work = __WORK_INITIALIZER(global_vmpressure.work, vmpressure_work_fn),
+};
+
+static struct vmpressure *vmpressure_get(struct mem_cgroup *memcg)
+{
+	struct vmpressure *vmpr = memcg_to_vmpressure(memcg);
+
+	return vmpr ? vmpr : &global_vmpressure;
+}
+
+static struct vmpressure *vmpressure_parent(struct vmpressure *vmpr)
+{
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+	struct mem_cgroup *memcg;
+
+	if (vmpr == &global_vmpressure)
+		return NULL;
+	/* Without use_hierarchy the cgroup has no parent to report to */
+	memcg = parent_mem_cgroup(vmpressure_to_memcg(vmpr));
+	if (!memcg)
+		return NULL;
+	return vmpressure_get(memcg);
+#else
+	return NULL;
+#endif
+}
+
+static enum vmpressure_levels vmpressure_level(unsigned long pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static unsigned long vmpressure_calc_pressure(unsigned long scanned,
+					      unsigned long reclaimed)
+{
+	/*
+	 * Reclaim may free more than it scanned (slab, compound pages),
+	 * which simply means there is no pressure.
+	 */
+	if (reclaimed >= scanned)
+		return 0;
+
+	return 100 - reclaimed * 100 / scanned;
+}
+
+static bool vmpressure_event(struct vmpressure *vmpr,
+			     enum vmpressure_levels level)
+{
+	struct vmpressure_event *ev;
+	bool signalled = false;
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->events, node) {
+		if (level >= ev->level) {
+			eventfd_signal(ev->efd, 1);
+			signalled = true;
+		}
+	}
+	mutex_unlock(&vmpr->events_lock);
+
+	return signalled;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = container_of(work, struct vmpressure, work);
+	enum vmpressure_levels level;
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long pressure;
+
+	spin_lock(&vmpr->sr_lock);
+	scanned = vmpr->scanned;
+	reclaimed = vmpr->reclaimed;
+	vmpr->scanned = 0;
+	vmpr->reclaimed = 0;
+	spin_unlock(&vmpr->sr_lock);
+
+	/*
+	 * Several reclaimers may have queued the work while it was
+	 * running; the first run consumed everything.
+	 */
+	if (!scanned)
+		return;
+
+	pressure = vmpressure_calc_pressure(scanned, reclaimed);
+	pr_debug("%s: %3lu (s: %lu r: %lu)\n", __func__, pressure,
+		 scanned, reclaimed);
+
+	level = vmpressure_level(pressure);
+	if (vmpr == &global_vmpressure)
+		blocking_notifier_call_chain(&vmpressure_notifier, level,
+					     &pressure);
+
+	/*
+	 * A cgroup that has listeners consumes the event; otherwise it
+	 * is propagated to the closest ancestor that is interested.
+	 */
+	do {
+		if (vmpressure_event(vmpr, level))
+			break;
+	} while ((vmpr = vmpressure_parent(vmpr)));
+}
+
+/**
+ * vmpressure() - Account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup memory controller handle, NULL for global reclaim
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * This function should be called from the reclaim path every time
+ * some pages are reclaimed.  It only accumulates the numbers; the
+ * pressure is computed and reported asynchronously once a window's
+ * worth of pages has been scanned, so the cost here is a spinlock.
+ */
+void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		unsigned long scanned, unsigned long reclaimed)
+{
+	struct vmpressure *vmpr = vmpressure_get(memcg);
+
+	/*
+	 * Only account pressure for allocations that could have used
+	 * highmem or movable memory: others (e.g. GFP_DMA, or small
+	 * atomic kernel allocations) only reflect pressure on a narrow
+	 * part of memory and would cause false positives.  I/O-less
+	 * reclaim can't do much, so don't account that either.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpr->sr_lock);
+	vmpr->scanned += scanned;
+	vmpr->reclaimed += reclaimed;
+	scanned = vmpr->scanned;
+	spin_unlock(&vmpr->sr_lock);
+
+	if (scanned < vmpressure_win)
+		return;
+	schedule_work(&vmpr->work);
+}
+
+/**
+ * vmpressure_prio() - Account memory pressure through reclaimer priority level
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup memory controller handle, NULL for global reclaim
+ * @prio:	reclaimer's priority
+ *
+ * This function should be called from the reclaim path every time
+ * the reclaimer's scanning priority goes down.
+ */
+void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio)
+{
+	/*
+	 * We only use prio for accounting critical level.  For more
+	 * info see comment for vmpressure_level_critical_prio variable
+	 * above.
+	 */
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	/*
+	 * OK, the prio is below the threshold, updating vmpressure
+	 * information before shrinker dives into long shrinking of
+	 * long lists.  This amounts to saying "a whole window was
+	 * scanned and nothing reclaimed", i.e. 100% pressure.
+	 */
+	vmpressure(gfp, memcg, vmpressure_win, 0);
+}
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+/**
+ * vmpressure_register_event() - Bind vmpressure notifications to an eventfd
+ * @cg:		cgroup that is interested in vmpressure notifications
+ * @cft:	cgroup control files handle
+ * @eventfd:	eventfd context to link notifications with
+ * @args:	event arguments (used to set up a pressure level threshold)
+ *
+ * This function associates eventfd context with the vmpressure
+ * infrastructure, so that the notifications will be delivered to the
+ * @eventfd.  The @args parameter is a string that denotes pressure level
+ * threshold ("low", "medium" or "critical"); a listener is notified of
+ * its level and of every level above it.
+ *
+ * This function should not be used directly, just pass it to (struct
+ * cftype).register_event, and then cgroup core will handle everything
+ * by itself.
+ */
+int vmpressure_register_event(struct cgroup *cg, struct cftype *cft,
+			      struct eventfd_ctx *eventfd, const char *args)
+{
+	struct vmpressure *vmpr = vmpressure_get(mem_cgroup_from_cont(cg));
+	struct vmpressure_event *ev;
+	int level;
+
+	for (level = 0; level < VMPRESSURE_NUM_LEVELS; level++) {
+		if (!strcmp(vmpressure_str_levels[level], args))
+			break;
+	}
+
+	if (level >= VMPRESSURE_NUM_LEVELS)
+		return -EINVAL;
+
+	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	if (!ev)
+		return -ENOMEM;
+
+	ev->efd = eventfd;
+	ev->level = level;
+
+	mutex_lock(&vmpr->events_lock);
+	list_add(&ev->node, &vmpr->events);
+	mutex_unlock(&vmpr->events_lock);
+
+	return 0;
+}
+
+/**
+ * vmpressure_unregister_event() - Unbind eventfd from vmpressure
+ * @cg:		cgroup handle
+ * @cft:	cgroup control files handle
+ * @eventfd:	eventfd context that was used to link vmpressure with the @cg
+ *
+ * This function does internal manipulations to detach the @eventfd from
+ * the vmpressure notifications, and then frees internal resources
+ * associated with the @eventfd (but the @eventfd itself is not freed).
+ *
+ * This function should not be used directly, just pass it to (struct
+ * cftype).unregister_event, and then cgroup core will handle everything
+ * by itself.
+ */
+void vmpressure_unregister_event(struct cgroup *cg, struct cftype *cft,
+				 struct eventfd_ctx *eventfd)
+{
+	struct vmpressure *vmpr = vmpressure_get(mem_cgroup_from_cont(cg));
+	struct vmpressure_event *ev;
+
+	mutex_lock(&vmpr->events_lock);
+	list_for_each_entry(ev, &vmpr->events, node) {
+		if (ev->efd != eventfd)
+			continue;
+		list_del(&ev->node);
+		kfree(ev);
+		break;
+	}
+	mutex_unlock(&vmpr->events_lock);
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR */
+
+/**
+ * vmpressure_init() - Initialize vmpressure control structure
+ * @vmpr:	Structure to be initialized
+ *
+ * This function should be called on every allocated vmpressure structure
+ * before any usage.
+ */
+void vmpressure_init(struct vmpressure *vmpr)
+{
+	spin_lock_init(&vmpr->sr_lock);
+	mutex_init(&vmpr->events_lock);
+	INIT_LIST_HEAD(&vmpr->events);
+	INIT_WORK(&vmpr->work, vmpressure_work_fn);
+}
+
+/**
+ * vmpressure_cleanup() - Shut down vmpressure control structure
+ * @vmpr:	Structure to be cleaned up
+ *
+ * This should be called before the structure is freed, to make sure
+ * that no work item is still pending or running on it.
+ */
+void vmpressure_cleanup(struct vmpressure *vmpr)
+{
+	cancel_work_sync(&vmpr->work);
+}